@@ -1467,6 +1467,7 @@ int ARM_DoCPUOpcode(int typ, int parm)
 //   ADRL    R1,.+$100000    ; E28F1FFE E2811BFF E2811703
 //   ADRL    R1,.+$10000000  ; E28F1FFE E2811BFF E28117FF E2811303
 
+lineKnown = FALSE;  // assemble it again in pass 2 for the debug output
 if (pass == 2)
 {
     printf("*** %.8X *** %s\n",val,line);
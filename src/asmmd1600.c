@@ -1054,16 +1054,27 @@ int MD1600_DoCPUOpcode(int typ, int parmIn)
 }
 
 
+void MD1600_PassInit(void)
+{
+    // the settings carry over into the next pass, but not into the next assembly
+    if (passNum == 1)
+    {
+        mdWordLength = 1;
+        mdSupportOldSyntax = 1;
+    }
+}
+
+
 void AsmMD1600Init(void)
 {
     char *p;
 
     // Microdata 1600
-    p = AddAsm(versionNameMD, &MD1600_DoCPUOpcode, NULL, NULL);
+    p = AddAsm(versionNameMD, &MD1600_DoCPUOpcode, NULL, &MD1600_PassInit);
     AddCPU(p, "MD1600", CPU1600, BIG_END, ADDR_16, LIST_24, 8, 0, MD1600_opcdTab);
 
     // Basic Four 1200,1300 and 1320
-    p = AddAsm(versionNameBF, &MD1600_DoCPUOpcode, NULL, NULL);
+    p = AddAsm(versionNameBF, &MD1600_DoCPUOpcode, NULL, &MD1600_PassInit);
     AddCPU(p, "BF1200", CPU1200, BIG_END, ADDR_16, LIST_24, 8, 0, BF_opcdTab);
     AddCPU(p, "BF1300", CPU1300, BIG_END, ADDR_16, LIST_24, 8, 0, BF_opcdTab);
     AddCPU(p, "BF1320", CPU1320, BIG_END, ADDR_16, LIST_24, 8, 0, BF_opcdTab);
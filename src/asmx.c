@@ -1,10 +1,20 @@
 // asmx.c - copyright 1998-2007 Bruce Tomlin
 
 #include "asmx.h"
+#include <sys/stat.h>
+#include <setjmp.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <errno.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define VERSION_NAME "asmx multi-assembler"
 
-//#define ENABLE_REP    // uncomment to enable REPEAT pseudo-op (still under development)
 //#define DOLLAR_SYM    // allow symbols to start with '$' (incompatible with $ for hexadecimal constants!)
 //#define TEMP_LBLAT    // enable use of '@' temporary labels (deprecated)
 
@@ -14,12 +24,22 @@
 #define COPYRIGHT "Copyright 1998-2007 Bruce Tomlin"
 #define IHEX_SIZE   32          // max number of data bytes per line in hex object file
 #define MAXSYMLEN   19          // max symbol length (only used in DumpSym())
+#define DUMPBUF_SIZE 65536      // size of output buffer for DumpSymTab()
 const int symTabCols = 3;       // number of columns for symbol table dump
 #define MAXMACPARMS 30          // maximum macro parameters
 #define MAX_INCLUDE 10          // maximum INCLUDE nesting level
 //#define MAX_BYTSTR  1024        // size of bytStr[] (moved to asmx.h)
 #define MAX_COND    256         // maximum nesting level of IF blocks
 #define MAX_MACRO   10          // maximum nesting level of MACRO invocations
+#define MAX_LOOP    1000000     // maximum times around a WHILE loop
+#define MAX_LINETOK 64          // maximum tokens remembered per source line
+#define MAX_EXPROP  128         // maximum operations in a compiled expression
+#define MAX_EXPRSTK 32          // maximum stack depth of a compiled expression
+#define MAX_EXPRNAMES 1024      // maximum bytes of names in a compiled expression
+#define MAX_EQUMISS 32          // maximum undefined symbols an EQU can wait for
+#define MAX_LINE    4096        // maximum length of a macro line after parameter substitution
+#define MAX_TOKEN   254         // maximum length of a word from GetWord, leaves room for GetWord(labl + 1)
+#define INCBIN_BUF  65536       // size of incBuf[]
 
 #if 0
 // these should already be defined in sys/types.h (included from stdio.h)
@@ -33,8 +53,87 @@ typedef   unsigned long   u_long;
 
 const char      *progname;      // pointer to argv[0]
 
+struct HashRec
+{
+    struct HashRec  *hnext;     // pointer to next entry in the same hash bucket
+    u_int           hash;       // hash value of key
+    char            *key;       // key string for this entry
+};
+typedef struct HashRec *HashPtr;
+
+struct HashTab
+{
+    HashPtr         *bucket;    // bucket array, size is always a power of two
+    u_int           size;       // number of buckets
+    u_int           count;      // number of entries
+};
+typedef struct HashTab *HashTabPtr;
+
+#define HASH_INIT   2166136261u                             // FNV-1a offset basis
+#define HASH_STEP(h,c) (((h) ^ (u_char) (c)) * 16777619u)   // FNV-1a step
+
+// character classes
+enum
+{
+    CC_SPACE  = 0x01,           // blank, tab or formfeed
+    CC_DIGIT  = 0x02,           // 0-9
+    CC_ALPHA  = 0x04,           // A-Z, a-z and '_'
+    CC_HEX    = 0x08,           // 0-9, A-F and a-f
+    CC_DOT    = 0x10,           // '.'
+    CC_LOWER  = 0x20,           // a-z, must be 0x20 for ToUpper()
+    CC_DOLLAR = 0x40,           // '$'
+    CC_AT     = 0x80,           // '@'
+    CC_ALNUM  = CC_DIGIT | CC_ALPHA
+};
+
+const u_char charClass[256] =
+{
+    [' ']  = CC_SPACE, ['\t'] = CC_SPACE, [12] = CC_SPACE,
+    ['0' ... '9'] = CC_DIGIT | CC_HEX,
+    ['A' ... 'F'] = CC_ALPHA | CC_HEX,
+    ['G' ... 'Z'] = CC_ALPHA,
+    ['a' ... 'f'] = CC_ALPHA | CC_HEX | CC_LOWER,
+    ['g' ... 'z'] = CC_ALPHA | CC_LOWER,
+    ['_']  = CC_ALPHA,
+    ['.']  = CC_DOT,
+    ['$']  = CC_DOLLAR,
+    ['@']  = CC_AT
+};
+
+#define CharClass(c)    (charClass[(u_char) (c)])
+#define isalphanum(c)   (CharClass(c) & CC_ALNUM)
+#define isalphaul(c)    (CharClass(c) & CC_ALPHA)
+#define ishex(c)        (CharClass(c) & CC_HEX)
+#define isblank_ff(c)   (CharClass(c) & CC_SPACE)
+#define ToUpper(c)      ((c) ^ (CharClass(c) & CC_LOWER))
+
+struct ArenaChunk
+{
+    struct ArenaChunk   *next;      // pointer to previous chunk
+    size_t              size;       // size of data[]
+    char                data[1];    // chunk storage, storage = size
+};
+typedef struct ArenaChunk *ArenaChunkPtr;
+
+struct Arena
+{
+    ArenaChunkPtr   chunk;      // current chunk, head of chunk list
+    char            *ptr;       // next free byte in current chunk
+    char            *end;       // end of current chunk
+    size_t          used;       // bytes handed out
+    size_t          total;      // bytes obtained from malloc
+    int             nchunks;    // number of chunks
+};
+typedef struct Arena *ArenaPtr;
+
+struct Arena    permArena;      // assemblers and CPU types, kept until exit
+struct Arena    asmArena;       // symbols, macros and segments, freed after each assembly
+struct Arena    strPool;        // names and macro text for asmArena objects
+struct Arena    lineArena;      // source files and their line records, kept by a server
+
 struct SymRec
 {
+    struct HashRec  h;          // hash table link, must be first
     struct SymRec   *next;      // pointer to next symtab entry
     u_long          value;      // symbol value
     bool            defined;    // TRUE if defined
@@ -42,35 +141,421 @@ struct SymRec
     bool            isSet;      // TRUE if defined with SET pseudo
     bool            equ;        // TRUE if defined with EQU pseudo
     bool            known;      // TRUE if value is known
-    char            name[1];    // symbol name, storage = 1 + length
+    int             defPass;    // passNum when last defined, 0 for -d and -i symbols
+    struct IncRec   *incRef;    // -u include record that last listed it as used
+    struct EquRec   *equDef;    // EQU of this pass 1 waiting for its operands, NULL if none
+    struct EquWait  *equWait;   // EQUs of this pass 1 waiting for this symbol
+    char            *name;      // symbol name, "PARENT.NAME" for local labels
 } *symTab = NULL;           // pointer to first entry in symbol table
 typedef struct SymRec *SymPtr;
+struct HashTab  symHash;        // hash index of global symbols in symTab
+int             symDefCount;    // number of DefSym calls, to see if a line defined a symbol
+u_long          symRefs;        // symbol and location uses by expressions, to see if a line used any
+
+struct ScopeRec
+{
+    struct HashRec  h;          // hash table link, key = parent label name
+    struct HashTab  syms;       // local labels owned by the parent label
+};
+typedef struct ScopeRec *ScopePtr;
+struct HashTab  scopeHash[2];   // scopes for '.' and '@' local labels
+ScopePtr        curScope[2];    // cached scopes for subrLabl/lastLabl, NULL if not looked up yet
+
+struct TokRec
+{
+    u_short         ofs;        // linePtr offset when the token was asked for
+    u_short         end;        // linePtr offset after the token
+    short           ret;        // return value of GetWord or GetOpcode
+    u_char          kind;       // TOK_WORD or TOK_OPCODE, plus the opts flags used by GetWord
+    char            *word;      // uppercase text of an alphanumeric token, else NULL
+};
+typedef struct TokRec *TokPtr;
+
+enum
+{
+    TOK_WORD   = 0x40,          // token from GetWord
+    TOK_OPCODE = 0x80           // token from GetOpcode
+};
+
+// an expression is compiled to postfix code the first time Eval reads it
+enum
+{
+    EX_CONST,                   // push u.val
+    EX_LOC,                     // push the current location
+    EX_SYM,                     // push the value of u.sym
+    EX_LOCAL,                   // push the value of local label u.name, token is '.' or '@'
+    EX_DEF,                     // push ..DEF u.name
+    EX_UNDEF,                   // push ..UNDEF u.name
+
+    EX_NEG,                     // unary operators
+    EX_NOT,
+    EX_LNOT,
+    EX_LOW,
+    EX_HIGH,
+
+    EX_MUL,                     // binary operators
+    EX_DIV,
+    EX_MOD,
+    EX_ADD,
+    EX_SUB,
+    EX_LT,
+    EX_LE,
+    EX_GT,
+    EX_GE,
+    EX_EQ,
+    EX_NE,
+    EX_AND,
+    EX_LAND,
+    EX_OR,
+    EX_LOR,
+    EX_XOR,
+    EX_SHL,
+    EX_SHR
+};
+
+struct ExprOp
+{
+    u_char          op;         // EX_ code
+    u_char          token;      // local label token for EX_LOCAL
+    union
+    {
+        int         val;        // EX_CONST value
+        SymPtr      sym;        // EX_SYM symbol
+        char        *name;      // EX_LOCAL, EX_DEF and EX_UNDEF name
+    } u;
+};
+typedef struct ExprOp *ExprOpPtr;
+
+struct ExprRec
+{
+    struct ExprRec  *next;      // next expression of the same line
+    u_short         ofs;        // linePtr offset of the expression
+    u_short         end;        // linePtr offset after the expression
+    u_char          kind;       // opts flags used by GetWord
+    u_char          nop;        // number of entries in op[]
+    struct ExprOp   op[1];      // postfix code, size = nop
+};
+typedef struct ExprRec *ExprPtr;
+
+struct LineRec
+{
+    TokPtr          tok;        // tokens read from this line
+    int             ntok;       // number of entries in tok[]
+    ExprPtr         expr;       // expressions compiled in job exprJob
+    u_int           exprJob;    // jobNum when expr[] was made, the symbols belong to the job
+};
+typedef struct LineRec *LinePtr;
+
+struct SrcRec
+{
+    struct HashRec  h;          // hash table link, key = file identity from SrcKey
+    char            *stamp;     // size and modification time from SrcKey
+    char            *name;      // file name it was first opened with
+    char            *text;      // file contents, with each line end changed to a null
+    u_int           *lineOfs;   // offset in text[] of each line, by line number
+    u_int           *condNext;  // first line from each line on that may be an IF, ELSE, ELSIF or ENDIF
+    u_int           *labelLine; // last line up to each line that may start with a label, 0 if none
+    LinePtr         *lines;     // line records, by line number
+    int             nlines;     // number of lines in text[]
+    u_long          size;       // number of bytes in text[]
+    char            sum[17];    // content hash for -u, empty until asked for
+};
+typedef struct SrcRec *SrcPtr;
+struct HashTab  srcHash;        // contents and line records of each source file
+SrcPtr          srcOld;         // files replaced by a newer version, freed after the job
+u_long          srcBytes;       // bytes malloc'ed for the text and tables of source files
+
+struct SrcNameRec
+{
+    struct HashRec  h;          // hash table link, key = file name as written
+    SrcPtr          src;        // the file it refers to
+};
+typedef struct SrcNameRec *SrcNamePtr;
+struct HashTab  srcNames;       // file names already looked up
+int             srcHits;        // file opens served from srcHash
+int             srcMisses;      // files read from disk
+LinePtr         *lineSlot;      // where the record for the text in line[] is kept, NULL if none
+LinePtr         curLine;        // record for the text in line[], NULL if none
+LinePtr         *lineId;        // source position of the text in line[], NULL if none
+
+// a line seen for the first time collects its tokens here, and is
+// copied into one block in an arena when the next line is read
+struct LineRec  newLine;        // record for a new line, curLine == &newLine
+struct TokRec   newTok[MAX_LINETOK]; // tokens of the new line
+char            newWords[MAX_LINETOK * 8]; // token text of the new line
+int             newWordLen;     // bytes used in newWords[]
+
+// pass 1 keeps one of these for each line in the order they were assembled,
+// so that pass 2 can reuse the code of lines that can't change
+struct IrRec
+{
+    LinePtr         *id;        // lineId of the line
+    u_long          loc;        // locPtr at the start of the line
+    struct CpuRec   *cpu;       // current CPU at the start of the line
+    bool            active;     // TRUE if not inside a failed IF
+    short           len;        // instrLen, positive for instructions and negative for data
+    int             hexSpaces;  // hexSpaces for listing an instruction
+    u_char          *code;      // the bytes, NULL if the line must be assembled again
+};
+typedef struct IrRec *IrPtr;
+IrPtr           irTab;          // line results of pass 1
+int             irCount;        // number of entries in irTab[]
+int             irMax;          // allocated size of irTab[]
+int             irNext;         // next entry for pass 2
+bool            irStop;         // TRUE if no more lines can be reused
+int             irHits;         // lines reused in pass 2
+
+u_int           jobNum;         // number of the current assembly, counting server jobs
+struct ExprOp   exprOp[MAX_EXPROP]; // code of the expression being compiled
+int             exprLen;        // number of entries in exprOp[]
+int             exprDepth;      // stack depth at the end of exprOp[]
+int             exprMaxDepth;   // largest stack depth used by exprOp[]
+char            exprNames[MAX_EXPRNAMES]; // local label and ..DEF names of exprOp[]
+int             exprNameLen;    // bytes used in exprNames[]
+bool            exprOn;         // TRUE while Eval is compiling an expression
+int             exprCount;      // expressions compiled
+int             exprHits;       // expressions evaluated from their code
+
+struct RunRec
+{
+    u_long          cod;        // codPtr of the first byte
+    u_long          ofs;        // offset of the first byte in oneCode[]
+    u_long          len;        // number of bytes, 0 to end the object record here
+};
+typedef struct RunRec *RunPtr;
+struct FixRec
+{
+    u_long          ofs;        // offset of the value in oneCode[]
+    u_long          loc;        // locPtr at the start of the line
+    struct CpuRec   *cpu;       // current CPU at the start of the line
+    ScopePtr        scope[2];   // local label scopes of the line
+    char            *expr;      // expression text
+    short           size;       // 1, 2 or 4 bytes
+    bool            big;        // TRUE if big-endian
+};
+typedef struct FixRec *FixPtr;
+bool            onePass;        // TRUE while pass 1 keeps the object code for -q
+bool            oneDone;        // TRUE if the second pass was not needed
+u_char          *oneCode;       // object code of pass 1
+u_long          oneLen;         // bytes used in oneCode[]
+u_long          oneMax;         // allocated size of oneCode[]
+RunPtr          runTab;         // addresses of the code in oneCode[]
+u_long          runCount;       // number of entries in runTab[]
+u_long          runMax;         // allocated size of runTab[]
+FixPtr          fixTab;         // values to patch in oneCode[]
+u_long          fixCount;       // number of entries in fixTab[]
+u_long          fixMax;         // allocated size of fixTab[]
+
+// with -u, pass 2 keeps one of these for each include file of the main
+// source, so that the next assembly can reuse it if nothing it used changed
+struct IncItem
+{
+    char            type;       // 'F' source file, 'B' INCBIN file, 'M' macro, 'R' symbol used,
+                                // 'D' symbol defined, 'C' code
+    bool            flag;       // 'R' used before it was defined, 'D' defined with EQU
+    int             scope;      // 'R' and 'D' offset of the '.' or '@' of a local label, else -1
+    u_long          value;      // symbol value, or codPtr of the code
+    u_long          ofs;        // 'C' offset of the code in code[]
+    u_long          len;        // 'C' number of bytes
+    char            *sum;       // 'F', 'B' and 'M' content hash
+    char            *name;      // file, macro or symbol name
+};
+typedef struct IncItem *IncItemPtr;
+struct IncRec
+{
+    char            *name;      // file name as written in the INCLUDE
+    int             occur;      // 1 for the first INCLUDE of this name, 2 for the second...
+    char            *cpu;       // CPU type at the INCLUDE
+    char            *state;     // incState at the INCLUDE
+    int             cond;       // condLevel at the INCLUDE
+    int             uid[2];     // macUniqueID at the INCLUDE and after it
+    u_long          loc[2];     // locPtr at the INCLUDE and after it
+    u_long          cod[2];     // codPtr at the INCLUDE and after it
+    char            *last[2];   // lastLabl at the INCLUDE and after it
+    char            *subr[2];   // subrLabl at the INCLUDE and after it
+    IncItemPtr      item;       // what it used and made
+    u_long          nitem;      // number of entries in item[]
+    u_long          maxitem;    // allocated size of item[]
+    u_char          *code;      // object code
+    u_long          ncode;      // bytes used in code[]
+    u_long          maxcode;    // allocated size of code[]
+    u_long          run;        // 1 + index in item[] of the last 'C' item, 0 if none
+    bool            bad;        // TRUE if it did something that can't be replayed
+    bool            skip;       // TRUE if replayed instead of assembled in this assembly
+    bool            failed;     // TRUE if replayed with a symbol that turned out different
+};
+typedef struct IncRec *IncPtr;
+bool            incOn;          // TRUE if -u records include files
+bool            incReuse;       // TRUE if -u may replay include files
+IncPtr          incRec;         // include file being recorded in pass 2, else NULL
+int             incOccur;       // occur of the INCLUDE being opened, 0 if not recorded
+IncPtr          *incOld;        // records from the state file
+u_long          incOldCount;    // number of entries in incOld[]
+u_long          incOldMax;      // allocated size of incOld[]
+IncPtr          *incNew;        // records for the next state file
+u_long          incNewCount;    // number of entries in incNew[]
+u_long          incNewMax;      // allocated size of incNew[]
+char            **incSeen;      // names of the include files in this pass
+u_long          incSeenCount;   // number of entries in incSeen[]
+u_long          incSeenMax;     // allocated size of incSeen[]
+unsigned long long incState;    // hash of the lines that may have changed a CPU's own state
+int             incSkips;       // include files replayed
+
+// in pass 1, an EQU that uses symbols not defined yet waits for them
+struct EquRec
+{
+    struct EquRec   *next;      // next record of the pass
+    SymPtr          sym;        // the symbol it defines
+    SymPtr          *need;      // undefined symbols used by expr
+    int             nneed;      // number of entries in need[]
+    int             waiting;    // entries of need[] not defined yet
+    u_long          loc;        // locPtr at the line
+    int             opts;       // opts at the line
+    int             wordDiv;    // wordDiv at the line
+    ScopePtr        scope[2];   // local label scopes of the line
+    char            *expr;      // expression text
+    char            *cycle;     // error message if it is part of a loop, else NULL
+    u_long          line;       // passLines when it was defined
+    bool            done;       // TRUE once the symbol is defined
+    char            mark;       // 1 while EquVisit is below it, 2 after
+};
+typedef struct EquRec *EquPtr;
+
+struct EquWait
+{
+    struct EquWait  *next;      // next record waiting for the same symbol
+    EquPtr          equ;        // the waiting record
+};
+typedef struct EquWait *EquWaitPtr;
+
+EquPtr          equTab;         // records of the last pass 1
+bool            equCollect;     // TRUE while Eval collects undefined symbols in equMiss[]
+SymPtr          equMiss[MAX_EQUMISS]; // undefined symbols used by the expression
+int             equMissCount;   // number of entries in equMiss[]
+bool            equMissLost;    // TRUE if an undefined symbol couldn't be put in equMiss[]
+int             equMissErrs;    // "Symbol undefined" errors of the expression
+int             equErrBase;     // errCount before the expression
+EquPtr          *equQueue;      // records whose operands are all defined
+u_long          equQueueCount;  // number of entries in equQueue[]
+u_long          equQueueMax;    // allocated size of equQueue[]
+bool            equBusy;        // TRUE while equQueue[] is being worked on
+int             equCycles;      // records found in loops after pass 1
+int             equDeferred;    // EQUs that waited for their operands
+int             equResolved;    // of those, defined before the end of pass 1
+u_long          passLines;      // lines assembled so far in this pass
+
+// a macro line is compiled to text pieces and substitutions when its macro ends
+enum
+{
+    MOP_TEXT,                   // copy len chars of the line from src
+    MOP_PARM,                   // parameter number parm, by name or by \1 to \9
+    MOP_NPARMS,                 // \0, the number of parameters
+    MOP_ID,                     // \?, the unique ID of the invocation
+    MOP_CAT                     // ##, remove the spaces before it
+};
+
+struct MacOp
+{
+    u_char              op;         // MOP_ code
+    u_char              parm;       // MOP_PARM parameter number
+    u_short             src;        // offset in the line where it starts
+    u_short             end;        // offset in the line where it ends
+};
+typedef struct MacOp *MacOpPtr;
 
 struct MacroLine
 {
     struct MacroLine    *next;      // pointer to next macro line
-    char                text[1];    // macro line, storage = 1 + length
+    struct LineRec      *rec;       // line record, used when no parameters are substituted
+    char                *text;      // macro line
+    MacOpPtr            op;         // compiled line, NULL until compiled
+    int                 nop;        // number of entries in op[]
+    int                 opOpts;     // symbol options op[] was compiled for
+    int                 len;        // length of the text used, at most MAX_LINE - 1
+    bool                subst;      // TRUE if the expanded text can differ from text
 };
 typedef struct MacroLine *MacroLinePtr;
 
 struct MacroParm
 {
     struct MacroParm    *next;      // pointer to next macro parameter name
-    char                name[1];    // macro parameter name, storage = 1 + length
+    char                *name;      // macro parameter name
 };
 typedef struct MacroParm *MacroParmPtr;
 
 struct MacroRec
 {
+    struct HashRec      h;          // hash table link, key = macro name
     struct MacroRec     *next;      // pointer to next macro
     bool                def;        // TRUE after macro is defined in pass 2
     bool                toomany;    // TRUE if too many parameters in definition
     MacroLinePtr        text;       // macro text
     MacroParmPtr        parms;      // macro parms
     int                 nparms;     // number of macro parameters
-    char                name[1];    // macro name, storage = 1 + length
+    int                 nlines;     // number of lines in text, set when it is compiled
+    bool                uid;        // TRUE if a line uses \?, set when it is compiled
+    struct IncRec       *incRef;    // -u include record that last listed it as used
+    char                *name;      // macro name
 } *macroTab = NULL;             // pointer to first entry in macro table
 typedef struct MacroRec *MacroPtr;
+struct HashTab  macroHash;      // hash index of macroTab
+
+// pass 1 keeps one of these for each macro definition in the order they were read,
+// so that pass 2 can list the body lines without looking at them again
+struct MacDef
+{
+    MacroPtr            macro;      // the macro defined
+    LinePtr             *id;        // lineId of the MACRO line
+    int                 nlines;     // lines between the MACRO and ENDM lines
+    char                *last;      // last label set by those lines, NULL if none
+    bool                addr;       // showAddr after those lines
+    bool                ok;         // FALSE if those lines had errors
+};
+typedef struct MacDef *MacDefPtr;
+MacDefPtr       macDefs;        // definitions of pass 1
+u_long          macDefCount;    // number of entries in macDefs[]
+u_long          macDefMax;      // allocated size of macDefs[]
+u_long          macDefNext;     // next entry for pass 2
+int             macDefSkips;    // body lines skipped in pass 2
+
+// an expansion that used nothing but its parameters is kept, so that the
+// same invocation can make the same lines again without assembling them
+enum
+{
+    MEMO_NEW,                   // first expansion being kept
+    MEMO_ONCE,                  // kept once, the next one at another address checks it
+    MEMO_OK,                    // the same at two addresses, used for the rest of the pass
+    MEMO_BAD                    // can't be kept
+};
+
+struct MemoLine
+{
+    char                *text;      // expanded line
+    u_char              *code;      // bytStr of the line
+    int                 len;        // instrLen of the line
+    int                 hexSpaces;  // hexSpaces of the line
+    bool                addr;       // showAddr of the line
+};
+typedef struct MemoLine *MemoLinePtr;
+
+struct MemoRec
+{
+    struct HashRec      h;          // hash table link, key = macro name and parameters
+    int                 state;      // MEMO_ code
+    u_long              gen;        // memoGen when it was kept
+    int                 opts;       // opts when it was kept
+    u_long              loc;        // locPtr of the first expansion
+    MemoLinePtr         lines;      // one for each line of the macro
+};
+typedef struct MemoRec *MemoPtr;
+struct HashTab  memoHash;       // expansions of this pass
+MemoPtr         memoRec;        // expansion being kept or checked, NULL if none
+int             memoLevel;      // macLevel of memoRec
+int             memoCount;      // lines of memoRec done so far
+u_long          memoGen;        // changed when a CPU module may have changed its own state
+MemoLinePtr     memoCur;        // kept line being used for the current line, NULL if none
+int             memoKept;       // expansions found the same at two addresses
+int             memoHits;       // expansions used again
 
 struct SegRec
 {
@@ -78,7 +563,7 @@ struct SegRec
 //  bool                gen;        // FALSE to supress code output (not currently implemented)
     u_long              loc;       // locptr for this segment
     u_long              cod;       // codptr for this segment
-    char                name[1];    // segment name, storage = 1 + length
+    char                *name;      // segment name
 } *segTab = NULL;               // pointer to first entry in macro table
 typedef struct SegRec *SegPtr;
 
@@ -99,12 +584,46 @@ int             macLevel;           // current macro nesting level
 int             macCurrentID[MAX_MACRO]; // current unique ID
 MacroPtr        macPtr[MAX_MACRO];  // current macro in use
 MacroLinePtr    macLine[MAX_MACRO]; // current macro text pointer
+MemoLinePtr     memoNext[MAX_MACRO]; // next kept line to use instead, NULL if none
 int             numMacParms[MAX_MACRO];  // number of macro parameters
-Str255          macParmsLine[MAX_MACRO]; // text of current macro parameters
+char            macParmsLine[MAX_MACRO][MAX_LINE]; // text of current macro parameters
 char            *macParms[MAXMACPARMS * MAX_MACRO]; // pointers to current macro parameters
-#ifdef ENABLE_REP
-int             macRepeat[MAX_MACRO]; // repeat count for REP pseudo-op
-#endif
+
+// a REPT, IRP or WHILE loop runs its body as a macro level of its own
+enum
+{
+    LOOP_NONE,                  // not a loop
+    LOOP_REPT,                  // REPT count[,var]
+    LOOP_IRP,                   // IRP var,item[,item...]
+    LOOP_WHILE                  // WHILE expr
+};
+
+struct LoopRec
+{
+    int                 kind;       // LOOP_ code, LOOP_NONE if the level is a macro
+    MacroPtr            body;       // lines of the loop
+    long                n;          // number of times around so far
+    long                count;      // REPT count or number of IRP items
+    char                *var;       // REPT symbol, NULL if none
+    char                **items;    // IRP items, in macParmsLine[] of the level
+    char                *expr;      // WHILE expression, in macParmsLine[] of the level
+};
+typedef struct LoopRec *LoopPtr;
+struct LoopRec  loopTab[MAX_MACRO]; // loop of each macro level
+
+// the body a loop line read, so that it can be used again
+struct LoopDef
+{
+    LinePtr             *id;        // lineId of the loop line
+    MacroPtr            body;       // its lines
+};
+typedef struct LoopDef *LoopDefPtr;
+LoopDefPtr      loopDefs;       // bodies read so far
+u_long          loopDefCount;   // number of entries in loopDefs[]
+u_long          loopDefMax;     // allocated size of loopDefs[]
+int             loopCount;      // loops run
+int             loopIters;      // times around them after the first
+int             loopReused;     // bodies used again
 
 struct AsmRec
 {
@@ -112,12 +631,13 @@ struct AsmRec
     int             (*DoCPUOpcode) (int typ, int parm);
     int             (*DoCPULabelOp) (int typ, int parm, char *labl);
     void            (*PassInit) (void);
-    char            name[1];        // name of this assembler
+    char            *name;          // name of this assembler
 };
 typedef struct AsmRec *AsmPtr;
 
 struct CpuRec
 {
+    struct HashRec  h;              // hash table link, key = name
     struct CpuRec   *next;          // next CpuRec
     AsmPtr          as;             // assembler for CPU type
     int             index;          // CPU type index for assembler
@@ -126,11 +646,48 @@ struct CpuRec
     int             listWid;        // listing hex area width, LIST_16 or LIST_24
     int             wordSize;       // addressing word size in bits
     OpcdPtr         opcdTab;        // opcdTab[] for this assembler
+    struct OpcdIdx  *opcdIdx;       // hash index of opcdTab[]
     int             opts;           // option flags
-    char            name[1];        // all-uppercase name of CPU
+    char            *name;          // all-uppercase name of CPU
 };
 typedef struct CpuRec *CpuPtr;
 
+struct OpcdHashRec
+{
+    struct HashRec  h;              // hash table link, key = opcode name or wildcard prefix
+    OpcdPtr         op;             // first entry in the opcode table with this key
+};
+typedef struct OpcdHashRec *OpcdHashPtr;
+
+struct OpcdIdx
+{
+    struct OpcdIdx  *next;          // next OpcdIdx
+    OpcdPtr         tab;            // indexed opcode table
+    struct HashTab  names;          // entries without a wildcard
+    struct HashTab  wild;           // "*" wildcard entries, keyed by the text before the '*'
+    int             minWild;        // length of shortest wildcard prefix
+    int             maxWild;        // length of longest wildcard prefix
+};
+typedef struct OpcdIdx *OpcdIdxPtr;
+
+struct RegRec
+{
+    struct HashRec  h;              // hash table link, key = register name
+    int             reg;            // index returned by FindReg
+};
+typedef struct RegRec *RegRecPtr;
+
+struct RegTab
+{
+    struct RegTab   *next;          // next RegTab in the same regTabs[] bucket
+    const char      *list;          // register list this table was built from
+    struct HashTab  names;          // register names
+};
+typedef struct RegTab *RegTabPtr;
+
+#define REGTAB_SIZE 64              // must be a power of two
+#define REGTAB_HASH(list) ((((size_t) (list)) >> 4 ^ ((size_t) (list))) & (REGTAB_SIZE - 1))
+
 // --------------------------------------------------------------
 
 SegPtr          curSeg;             // current segment
@@ -138,13 +695,20 @@ SegPtr          nullSeg;            // default null segment
 
 u_long          locPtr;             // Current program address
 u_long          codPtr;             // Current program "real" address
-int             pass;               // Current assembler pass
+int             pass;               // Current assembler pass, 1 while sizing and 2 for the last pass
+int             passNum;            // number of the current pass, counting all of them
+int             symChanged;         // symbols whose value changed in this pass
+bool            passUnknown;        // TRUE if this pass used a forward reference
 bool            warnFlag;           // TRUE if warning occurred this line
 bool            errFlag;            // TRUE if error occurred this line
 int             errCount;           // Total number of errors
 
-Str255          line;               // Current line from input file
+char            lineBuf[MAX_LINE];  // text of macro lines and other generated lines
+char           *line = lineBuf;     // Current line, in lineBuf[] or in a source file's text
+int             lineLen;            // length of current line
 char           *linePtr;            // pointer into current line
+const char     *spanText;           // text of the source file line[] was last read from
+const char     *spanEnd;            // end of spanText, nothing past it may be read
 Str255          listLine;           // Current listing line
 bool            listLineFF;         // TRUE if an FF was in the current listing line
 bool            listFlag;           // FALSE to suppress listing source
@@ -166,6 +730,9 @@ enum {
     condTRUE = 2, // condition is currently true
     condFAIL = 4  // condition has failed (to handle ELSE after ELSIF)
 };
+bool            condSkip;           // TRUE if the next line is read in a failed IF block
+int             condJumps;          // times lines of a failed IF block were passed over
+u_long          condSkipped;        // lines passed over
 
 int             instrLen;           // Current instruction length (negative to display as long DB)
 u_char          bytStr[MAX_BYTSTR]; // Current instruction / buffer for long DB statements
@@ -189,20 +756,34 @@ u_long          cl_Binend;          // end address for OBJ_BIN
 int             cl_S9type;          // type of S9 file: 9, 19, 28, or 37
 bool            cl_Stdout;          // TRUE to send object file to stdout
 bool            cl_ListP1;          // TRUE to show listing in first assembler pass
+bool            cl_Verbose;         // TRUE to show statistics at end of assembly
+bool            cl_CpuFlush;        // TRUE to end the object record on a CPU change
+int             cl_Passes;          // maximum number of passes
+bool            cl_OnePass;         // TRUE to try assembling in one pass
+bool            cl_Incr;            // TRUE to reuse unchanged include files
+Str255          cl_ImportName;      // symbol import file name
+Str255          cl_ExportName;      // symbol export file name
+jmp_buf         *jobExit;           // where a server goes on AsmExit, NULL if not serving
 
-FILE            *source;            // source input file
 FILE            *object;            // object output file
 FILE            *listing;           // listing output file
 FILE            *incbin;            // binary include file
-FILE            *(include[MAX_INCLUDE]);    // include files
+u_char          incBuf[INCBIN_BUF]; // INCBIN data on its way to CodeBlock
 Str255          incname[MAX_INCLUDE];       // include file names
+struct SrcRec   *incSrc[MAX_INCLUDE];       // include file line records
+struct SrcRec   *srcMain;           // source file line records
 int             incline[MAX_INCLUDE];       // include line number
 int             nInclude;           // current include file index
 
 bool            evalKnown;          // TRUE if all operands in Eval were "known"
+bool            lineKnown;          // TRUE if the line's code can be reused in pass 2
+bool            lineFixed;          // TRUE if the line has -q fixups
+bool            evalSet;            // set when an expression uses a SET symbol
 
 AsmPtr          asmTab;             // list of all assemblers
 CpuPtr          cpuTab;             // list of all CPU types
+struct HashTab  cpuHash;            // hash table of CPU types
+CpuPtr          curCpuRec;          // current CPU type
 AsmPtr          curAsm;             // current assembler
 int             curCPU;             // current CPU index for current assembler
 
@@ -214,6 +795,10 @@ int             wordSize;           // current CPU's addressing size in bits
 int             wordDiv;            // scaling factor for current word size
 int             addrMax;            // maximum addrWid used
 OpcdPtr         opcdTab;            // current CPU's opcode table
+OpcdIdxPtr      opcdIdx;            // current CPU's opcode table index
+OpcdIdxPtr      opcdIdx2;           // index of opcdTab2[]
+OpcdIdxPtr      opcdIdxTab;         // list of all opcode table indexes
+RegTabPtr       regTabs[REGTAB_SIZE]; // compiled register lists, by list address
 Str255          defCPU;             // default CPU name
 
 // --------------------------------------------------------------
@@ -241,9 +826,7 @@ enum
     o_Include,  // INCLUDE pseudo-op
 
     o_ENDM,     // ENDM pseudo-op
-#ifdef ENABLE_REP
-    o_REPEND,   // REPEND pseudo-op
-#endif
+    o_REPEND,   // ENDR pseudo-op
     o_MacName,  // Macro name
     o_Processor,// CPU selection pseudo-op
 
@@ -261,9 +844,7 @@ enum
     o_ERROR,    // ERROR pseudo-op
     o_ASSERT,   // ASSERT pseudo-op
     o_MACRO,    // MACRO pseudo-op
-#ifdef ENABLE_REP
-    o_REPEAT,   // REPEAT pseudo-op
-#endif
+    o_REPEAT,   // REPT, IRP and WHILE pseudo-ops
     o_Incbin,   // INCBIN pseudo-op
     o_WORDSIZE, // WORDSIZE pseudo-op
 
@@ -316,9 +897,9 @@ struct OpcdRec opcdTab2[] =
     {"ENDM",      o_ENDM,     0},
     {"ALIGN",     o_ALIGN,    0},
     {"EVEN",      o_ALIGN_n,  2},
-#ifdef ENABLE_REP
+    {"ENDR",      o_REPEND,   0},
     {"REPEND",    o_REPEND,   0},
-#endif
+    {"ENDW",      o_REPEND,   0},
     {"INCLUDE",   o_Include,  0},
     {"INCBIN",    o_Incbin,   0},
     {"PROCESSOR", o_Processor,0},
@@ -337,9 +918,10 @@ struct OpcdRec opcdTab2[] =
     {"OPT",       o_OPT,      0},
     {"ERROR",     o_ERROR,    0},
     {"ASSERT",    o_ASSERT,   0},
-#ifdef ENABLE_REP
-    {"REPEAT",    o_REPEAT,   0},
-#endif
+    {"REPT",      o_REPEAT,   LOOP_REPT},
+    {"REPEAT",    o_REPEAT,   LOOP_REPT},
+    {"IRP",       o_REPEAT,   LOOP_IRP},
+    {"WHILE",     o_REPEAT,   LOOP_WHILE},
     {"MACRO",     o_MACRO,    0},
     {"SEG",       o_SEG,      1},
     {"RSEG",      o_SEG,      1},
@@ -358,26 +940,153 @@ struct OpcdRec opcdTab2[] =
 
 // --------------------------------------------------------------
 
-#ifdef ENABLE_REP
 void DoLine(void);          // forward declaration
-#endif
+
+/*
+ *  AsmExit - stop the assembly after a fatal error
+ *
+ *  A server only gives up on the current job.
+ */
+
+void AsmExit(int status)
+{
+    if (jobExit)
+        longjmp(*jobExit, status);
+    exit(status);
+}
+
+// --------------------------------------------------------------
+// memory arenas
+
+#define ARENA_CHUNK 65536       // default size of an arena chunk
+#define ARENA_ALIGN sizeof(void *)
+
+
+/*
+ *  ArenaGrow - start a new chunk with room for at least size bytes
+ */
+
+void ArenaGrow(ArenaPtr a, size_t size)
+{
+    ArenaChunkPtr   c;
+    size_t          n;
+
+    n = ARENA_CHUNK;
+    if (size + ARENA_ALIGN > n) n = size + ARENA_ALIGN;
+
+    c = malloc(sizeof *c + n);
+    if (c == NULL)
+    {
+        fprintf(stderr,"%s: out of memory\n",progname);
+        AsmExit(1);
+    }
+
+    c -> next = a -> chunk;
+    c -> size = n;
+    a -> chunk = c;
+    a -> ptr = c -> data;
+    a -> end = c -> data + n;
+    a -> total = a -> total + sizeof *c + n;
+    a -> nchunks++;
+}
+
+
+/*
+ *  ArenaAlloc - bump-pointer allocation from an arena
+ */
+
+void *ArenaAlloc(ArenaPtr a, size_t size)
+{
+    char *p;
+
+    // keep objects pointer-aligned
+    p = (char *) (((size_t) a -> ptr + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1));
+    if (a -> chunk == NULL || p + size > a -> end)
+    {
+        ArenaGrow(a, size);
+        p = (char *) (((size_t) a -> ptr + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1));
+    }
+
+    a -> ptr = p + size;
+    a -> used = a -> used + size;
+
+    return p;
+}
+
+
+/*
+ *  ArenaStr - copy a string into an arena (unaligned, for string pools)
+ */
+
+char *ArenaStr(ArenaPtr a, const char *s)
+{
+    size_t  len;
+    char    *p;
+
+    len = strlen(s) + 1;
+    if (a -> chunk == NULL || a -> ptr + len > a -> end)
+        ArenaGrow(a, len);
+
+    p = a -> ptr;
+    memcpy(p, s, len);
+    a -> ptr = p + len;
+    a -> used = a -> used + len;
+
+    return p;
+}
+
+
+/*
+ *  ArenaFree - release everything allocated from an arena
+ */
+
+void ArenaFree(ArenaPtr a)
+{
+    ArenaChunkPtr   c,next;
+
+    for (c = a -> chunk; c; c = next)
+    {
+        next = c -> next;
+        free(c);
+    }
+
+    memset(a, 0, sizeof *a);
+}
+
+
+void ArenaReport(ArenaPtr a, char *name)
+{
+    fprintf(stderr, "%-12s %10lu bytes used, %10lu bytes in %d chunk(s)\n",
+            name, (u_long) a -> used, (u_long) a -> total, a -> nchunks);
+}
+
 
 // --------------------------------------------------------------
 
 // multi-assembler call vectors
 
+void IncState(void);
+
 int DoCPUOpcode(int typ, int parm)
 {
-    if (curAsm && curAsm -> DoCPUOpcode)
-        return curAsm -> DoCPUOpcode(typ,parm);
+    if (curAsm && curAsm -> DoCPUOpcode && curAsm -> DoCPUOpcode(typ,parm))
+    {
+        if (instrLen == 0)
+            IncState();     // it may have changed the CPU's own state
+        return 1;
+    }
     else return 0;
 }
 
 
 int DoCPULabelOp(int typ, int parm, char *labl)
 {
-    if (curAsm && curAsm -> DoCPULabelOp)
-        return curAsm -> DoCPULabelOp(typ,parm,labl);
+    if (curAsm && curAsm -> DoCPULabelOp && curAsm -> DoCPULabelOp(typ,parm,labl))
+    {
+        if (instrLen == 0 && typ != o_EQU)
+            IncState();     // it may have changed the CPU's own state
+        return 1;
+    }
     else return 0;
 }
 
@@ -404,9 +1113,9 @@ void *AddAsm(char *name,        // assembler name
 {
     AsmPtr p;
 
-    p = malloc(sizeof *p + strlen(name));
+    p = ArenaAlloc(&permArena, sizeof *p);
 
-    strcpy(p -> name, name);
+    p -> name     = ArenaStr(&permArena, name);
     p -> next     = asmTab;
     p -> DoCPUOpcode  = DoCPUOpcode;
     p -> DoCPULabelOp = DoCPULabelOp;
@@ -417,6 +1126,11 @@ void *AddAsm(char *name,        // assembler name
     return p;
 }
 
+OpcdIdxPtr IndexOpcodeTab(OpcdPtr tab);
+u_int HashStr(const char *s);
+HashPtr HashFind(HashTabPtr t, const char *key, u_int hash);
+void HashAdd(HashTabPtr t, HashPtr p, u_int hash);
+
 void AddCPU(void *as,           // assembler for this CPU
             char *name,         // uppercase name of this CPU
             int index,          // index number for this CPU
@@ -429,9 +1143,9 @@ void AddCPU(void *as,           // assembler for this CPU
 {
     CpuPtr p;
 
-    p = malloc(sizeof *p + strlen(name));
+    p = ArenaAlloc(&permArena, sizeof *p);
 
-    strcpy(p -> name, name);
+    p -> name  = ArenaStr(&permArena, name);
     p -> next  = cpuTab;
     p -> as    = (AsmPtr) as;
     p -> index = index;
@@ -441,6 +1155,13 @@ void AddCPU(void *as,           // assembler for this CPU
     p -> wordSize = wordSize;
     p -> opts     = opts;
     p -> opcdTab  = opcdTab;
+    p -> opcdIdx  = NULL;
+    if (opcdTab)
+        p -> opcdIdx = IndexOpcodeTab(opcdTab);
+
+    // a later CPU with the same name hides the earlier one, as in cpuTab
+    p -> h.key = p -> name;
+    HashAdd(&cpuHash, &p -> h, HashStr(p -> name));
 
     cpuTab = p;
 }
@@ -448,17 +1169,7 @@ void AddCPU(void *as,           // assembler for this CPU
 
 CpuPtr FindCPU(char *cpuName)
 {
-    CpuPtr p;
-
-    p = cpuTab;
-    while (p)
-    {
-        if (strcmp(cpuName,p->name) == 0)
-            return p;
-        p = p -> next;
-    }
-
-    return NULL;
+    return (CpuPtr) HashFind(&cpuHash, cpuName, HashStr(cpuName));
 }
 
 
@@ -469,14 +1180,15 @@ void SetWordSize(int wordSize)
 
 
 void CodeFlush(void);
-// sets up curAsm and curCpu based on cpuName, returns non-zero if success
-bool SetCPU(char *cpuName)
+void IncBad(void);
+// makes p the current CPU, returns non-zero if success
+bool SelectCPU(CpuPtr p)
 {
-    CpuPtr p;
-
-    p = FindCPU(cpuName);
     if (p)
     {
+        IncBad();
+        memoGen++;
+        curCpuRec = p;
         curCPU   = p -> index;
         curAsm   = p -> as;
         endian   = p -> endian;
@@ -484,10 +1196,12 @@ bool SetCPU(char *cpuName)
         listWid  = p -> listWid;
         wordSize = p -> wordSize;
         opcdTab  = p -> opcdTab;
+        opcdIdx  = p -> opcdIdx;
         opts     = p -> opts;
         SetWordSize(wordSize);
 
-        CodeFlush();    // make a visual change in the hex object file
+        if (cl_CpuFlush)
+            CodeFlush();    // make a visual change in the hex object file
 
         return 1;
     }
@@ -496,7 +1210,13 @@ bool SetCPU(char *cpuName)
 }
 
 
-int isalphanum(char c);
+// sets up curAsm and curCpu based on cpuName, returns non-zero if success
+bool SetCPU(char *cpuName)
+{
+    return SelectCPU(FindCPU(cpuName));
+}
+
+
 void Uprcase(char *s);
 
 
@@ -506,6 +1226,8 @@ void AsmInit(void)
 
 #define ASSEMBLER(name) extern void Asm ## name ## Init(void); Asm ## name ## Init();
 
+    opcdIdx2 = IndexOpcodeTab(opcdTab2);
+
     p = AddAsm("None", NULL, NULL, NULL);
     AddCPU(p, "NONE",  0, UNKNOWN_END, ADDR_32, LIST_24, 8, 0, NULL);
 
@@ -527,8 +1249,21 @@ void AsmInit(void)
     ASSEMBLER(MD1600);
 
 //  strcpy(defCPU,"Z80");     // hard-coded default for testing
+}
+
+
+/*
+ *  DefaultCPU - get the default CPU type from the executable's name
+ */
+
+void DefaultCPU(void)
+{
+    char *p;
 
-    strcpy(line,progname);
+    defCPU[0] = 0;
+
+    strncpy(line,progname,MAX_LINE - 1);
+    line[MAX_LINE - 1] = 0;
     Uprcase(line);
 
     // try to find the CPU name in the executable's name
@@ -569,6 +1304,7 @@ void Error(char *message)
 
     errFlag = TRUE;
     errCount++;
+    IncBad();       // so that the line is shown again next time
 
     name = cl_SrcName;
     line = linenum;
@@ -597,6 +1333,7 @@ void Warning(char *message)
     int line;
 
     warnFlag = TRUE;
+    IncBad();
 
     name = cl_SrcName;
     line = linenum;
@@ -667,29 +1404,66 @@ void Uprcase(char *s)
 {
     char *p = s;
 
-    while ((*p = toupper(*p)))
+    while ((*p = ToUpper(*p)))
         p++;
 }
 
 
-int ishex(char c)
+/*
+ *  SpanChars - returns the number of chars at the start of s
+ *              which are in any of the character classes in cc
+ *
+ *  With SSE2, 16 chars at a time are checked while s is in the text
+ *  of a source file and all 16 are before its end.  Anywhere else the
+ *  length of the buffer is not known, so only the table loop is safe.
+ */
+
+int SpanChars(const char *s, int cc)
 {
-    c = toupper(c);
-    return isdigit(c) || ('A' <= c && c <= 'F');
-}
+    const char *p = s;
 
+#ifdef __SSE2__
+    __m128i     v,m,t;
+    u_int       bits;
 
-int isalphaul(char c)
-{
-    c = toupper(c);
-    return ('A' <= c && c <= 'Z') || c == '_';
-}
+    if ((size_t) p >= (size_t) spanText && (size_t) p < (size_t) spanEnd
+                && !(cc & ~(CC_ALNUM | CC_DOT | CC_DOLLAR | CC_AT)))
+        while (spanEnd - p >= 16)
+        {
+            v = _mm_loadu_si128((const __m128i *) p);
+            m = _mm_setzero_si128();
+
+            // a signed compare after the add checks a range of chars
+            if (cc & CC_DIGIT)
+            {
+                t = _mm_add_epi8(v, _mm_set1_epi8((char) (0x80 - '0')));
+                m = _mm_or_si128(m, _mm_cmplt_epi8(t, _mm_set1_epi8((char) (0x80 + 10))));
+            }
+            if (cc & CC_ALPHA)
+            {
+                t = _mm_add_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8((char) (0x80 - 'a')));
+                m = _mm_or_si128(m, _mm_cmplt_epi8(t, _mm_set1_epi8((char) (0x80 + 26))));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+            }
+            if (cc & CC_DOT)
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+            if (cc & CC_DOLLAR)
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+            if (cc & CC_AT)
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('@')));
+
+            // a zero bit is the first char that is not in the span
+            bits = ~_mm_movemask_epi8(m) & 0xFFFF;
+            if (bits)
+                return p + __builtin_ctz(bits) - s;
+            p = p + 16;
+        }
+#endif
 
+    while (CharClass(*p) & cc)
+        p++;
 
-int isalphanum(char c)
-{
-    c = toupper(c);
-    return isdigit(c) || ('A' <= c && c <= 'Z') || c == '_';
+    return p - s;
 }
 
 
@@ -702,12 +1476,11 @@ u_int EvalBin(char *binStr)
     evalErr = FALSE;
     binVal  = 0;
 
-    while ((c = *binStr++))
+    while ((c = (u_char) *binStr++))
     {
-        if (c < '0' || c > '1')
-            evalErr = TRUE;
-        else
-            binVal = binVal * 2 + c - '0';
+        c = c - '0';
+        evalErr |= (u_int) c > 1;
+        binVal = binVal * 2 + (c & 1);
     }
 
     if (evalErr)
@@ -729,12 +1502,11 @@ u_int EvalOct(char *octStr)
     evalErr = FALSE;
     octVal  = 0;
 
-    while ((c = *octStr++))
+    while ((c = (u_char) *octStr++))
     {
-        if (c < '0' || c > '7')
-            evalErr = TRUE;
-        else
-            octVal = octVal * 8 + c - '0';
+        c = c - '0';
+        evalErr |= (u_int) c > 7;
+        octVal = octVal * 8 + (c & 7);
     }
 
     if (evalErr)
@@ -756,12 +1528,11 @@ u_int EvalDec(char *decStr)
     evalErr = FALSE;
     decVal  = 0;
 
-    while ((c = *decStr++))
+    while ((c = (u_char) *decStr++))
     {
-        if (!isdigit(c))
-            evalErr = TRUE;
-        else
-            decVal = decVal * 10 + c - '0';
+        c = c - '0';
+        evalErr |= (u_int) c > 9;
+        decVal = decVal * 10 + c;
     }
 
     if (evalErr)
@@ -774,12 +1545,20 @@ u_int EvalDec(char *decStr)
 }
 
 
+// hex digit values, 0xFF if not a hex digit
+const u_char hexValue[256] =
+{
+    [0 ... 255] = 0xFF,
+    ['0'] =  0, ['1'] =  1, ['2'] =  2, ['3'] =  3, ['4'] =  4,
+    ['5'] =  5, ['6'] =  6, ['7'] =  7, ['8'] =  8, ['9'] =  9,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15
+};
+
+
 int Hex2Dec(char c)
 {
-    c = toupper(c);
-    if (c > '9')
-        return c - 'A' + 10;
-    return c - '0';
+    return hexValue[(u_char) c] & 15;
 }
 
 
@@ -792,12 +1571,11 @@ u_int EvalHex(char *hexStr)
     evalErr = FALSE;
     hexVal  = 0;
 
-    while ((c = *hexStr++))
+    while ((c = (u_char) *hexStr++))
     {
-        if (!ishex(c))
-            evalErr = TRUE;
-        else
-            hexVal = hexVal * 16 + Hex2Dec(c);
+        c = hexValue[c];
+        evalErr |= c >> 4;
+        hexVal = hexVal * 16 + (c & 15);
     }
 
     if (evalErr)
@@ -1109,23 +1887,48 @@ void ConvertZSCII(void)
 // --------------------------------------------------------------
 // token handling
 
+
+// copy an n-char word from linePtr to word in uppercase,
+// keeping only the first MAX_TOKEN chars of a longer one
+void CopyToken(char *word, int n)
+{
+    char    *p;
+    char    c;
+
+    p = linePtr;
+    linePtr = linePtr + n;
+    if (n > MAX_TOKEN)
+        n = MAX_TOKEN;
+
+    while (n--)
+    {
+        c = *p++;
+        *word++ = ToUpper(c);
+    }
+    *word = 0;
+}
+
+
 // returns 0 for end-of-line, -1 for alpha-numeric, else char value for non-alphanumeric
 // converts the word to uppercase, too
-int GetWord(char *word)
+int LexWord(char *word)
 {
     u_char  c;
+    int     n;
 
     word[0] = 0;
 
     // skip initial whitespace
     c = *linePtr;
-    while (c == 12 || c == '\t' || c == ' ')
+    while (isblank_ff(c))
         c = *++linePtr;
 
     // skip comments
     if (c == ';')
-        while (c)
-            c = *++linePtr;
+    {
+        linePtr = linePtr + strlen(linePtr);
+        c = 0;
+    }
 
     // test for end of line
     if (c)
@@ -1151,12 +1954,8 @@ int GetWord(char *word)
 
 #endif
         {
-            while (isalphanum(c) || c == '$' || ((opts & OPT_ATSYM) && c == '@'))
-            {
-                *word++ = toupper(c);
-                c = *++linePtr;
-            }
-            *word = 0;
+            n = SpanChars(linePtr, CC_ALNUM | CC_DOLLAR | ((opts & OPT_ATSYM) ? CC_AT : 0));
+            CopyToken(word, n);
             return -1;
         }
         else
@@ -1172,22 +1971,25 @@ int GetWord(char *word)
 }
 
 
-// same as GetWord, except it allows '.' chars in alphanumerics and ":=" as a token
-int GetOpcode(char *word)
+// same as LexWord, except it allows '.' chars in alphanumerics and ":=" as a token
+int LexOpcode(char *word)
 {
     u_char  c;
+    int     n;
 
     word[0] = 0;
 
     // skip initial whitespace
     c = *linePtr;
-    while (c == 12 || c == '\t' || c == ' ')
+    while (isblank_ff(c))
         c = *++linePtr;
 
     // skip comments
     if (c == ';')
-        while (c)
-            c = *++linePtr;
+    {
+        linePtr = linePtr + strlen(linePtr);
+        c = 0;
+    }
 
     // test for ":="
     if (c == ':' && linePtr[1] == '=')
@@ -1205,12 +2007,8 @@ int GetOpcode(char *word)
         // test for alphanumeric token
         if (isalphanum(c) || c=='.')
         {
-            while (isalphanum(c) || c=='.')
-            {
-                *word++ = toupper(c);
-                c = *++linePtr;
-            }
-            *word = 0;
+            n = SpanChars(linePtr, CC_ALNUM | CC_DOT);
+            CopyToken(word, n);
             return -1;
         }
         else
@@ -1226,7 +2024,140 @@ int GetOpcode(char *word)
 }
 
 
-void GetFName(char *word)
+/*
+ *  FindLine - get the record for the current line, or start a new one
+ */
+
+LinePtr FindLine(void)
+{
+    // token offsets are kept in a u_short
+    if (lineSlot == NULL || lineLen > 0xFFFF)
+        return NULL;
+
+    if (*lineSlot)
+        return *lineSlot;
+
+    newLine.tok  = newTok;
+    newLine.ntok = 0;
+    newLine.expr = NULL;
+    newLine.exprJob = jobNum;
+    newWordLen   = 0;
+    return &newLine;
+}
+
+
+/*
+ *  SaveLine - copy the new line record and its tokens into an arena
+ */
+
+LinePtr SaveLine(ArenaPtr a)
+{
+    LinePtr p;
+    TokPtr  t;
+    char    *s;
+    int     i;
+
+    p = ArenaAlloc(a, sizeof *p + newLine.ntok * sizeof *t + newWordLen);
+    t = (TokPtr) (p + 1);
+    s = (char *) (t + newLine.ntok);
+
+    p -> tok  = t;
+    p -> ntok = newLine.ntok;
+    p -> expr = newLine.expr;
+    p -> exprJob = newLine.exprJob;
+    memcpy(s, newWords, newWordLen);
+    for (i = 0; i < newLine.ntok; i++)
+    {
+        t[i] = newTok[i];
+        if (t[i].word)
+            t[i].word = s + (newTok[i].word - newWords);
+    }
+
+    return p;
+}
+
+
+/*
+ *  LineToken - get a token from the current line record, reading it
+ *              from the line only the first time it is asked for
+ */
+
+int LineToken(char *word, int kind)
+{
+    TokPtr  t;
+    int     ofs,i;
+    int     ret;
+
+    ofs = linePtr - line;
+
+    // a record always belongs to the same line text, so the same
+    // request at the same place always gets the same token back
+    t = curLine -> tok;
+    for (i = curLine -> ntok; i > 0; i--, t++)
+        if (t -> ofs == ofs && t -> kind == kind)
+        {
+            linePtr = line + t -> end;
+            if (t -> word)
+                strcpy(word, t -> word);
+            else
+            {
+                word[0] = t -> ret;
+                word[1] = 0;
+            }
+            return t -> ret;
+        }
+
+    if (kind & TOK_OPCODE)
+        ret = LexOpcode(word);
+    else
+        ret = LexWord(word);
+
+    // only a new line can learn more tokens, anything else
+    // is a different path through an old line, and rare
+    if (curLine == &newLine && newLine.ntok < MAX_LINETOK)
+    {
+        t = &newTok[newLine.ntok];
+        t -> word = NULL;
+        if (ret == -1)
+        {
+            i = strlen(word) + 1;
+            if (newWordLen + i > (int) sizeof(newWords)) return ret;
+            t -> word = memcpy(newWords + newWordLen, word, i);
+            newWordLen += i;
+        }
+        t -> ofs  = ofs;
+        t -> end  = linePtr - line;
+        t -> ret  = ret;
+        t -> kind = kind;
+        newLine.ntok++;
+    }
+
+    return ret;
+}
+
+
+// tokens come from the line record while DoLine is working on line[]
+#define LINETOK_OK() (curLine && linePtr >= line && linePtr <= line + lineLen)
+
+int GetWord(char *word)
+{
+    if (LINETOK_OK())
+        return LineToken(word, TOK_WORD | (opts & (OPT_ATSYM | OPT_DOLLARSYM)));
+
+    return LexWord(word);
+}
+
+
+int GetOpcode(char *word)
+{
+    if (LINETOK_OK())
+        return LineToken(word, TOK_OPCODE);
+
+    return LexOpcode(word);
+}
+
+
+void GetFName(char *word)
 {
     char            *oldLine;
     int             ch;
@@ -1248,7 +2179,8 @@ void GetFName(char *word)
         ch = *linePtr++;
         if (ch == '\\' && *linePtr != 0)
             ch = *linePtr++;
-        *oldLine++ = ch;
+        if (oldLine < word + 255)
+            *oldLine++ = ch;
     }
     *oldLine++ = 0;
 
@@ -1328,50 +2260,6 @@ void BadMode()
 }
 
 
-// find a register name
-// regList is a space-separated list of register names
-// FindReg returns:
-//       -2 (aka reg_EOL) if empty string
-//      -1 (aka reg_None) if no register found
-//      0 if regName is the first register in regList
-//      1 if regName is the second register in regList
-//      etc.
-int FindReg(const char *regName, const char *regList)
-{
-    const char *p;
-    int i;
-
-    if (!regName[0]) return reg_EOL;
-
-    i = 0;
-    while (*regList)
-    {
-        p = regName;
-        // compare words
-        while (*p && *p == *regList)
-        {
-            regList++;
-            p++;
-        }
-
-        // if not match, skip rest of word
-        if (*p || (*regList != 0 && *regList != ' '))
-        {
-            // skip to next whitespace
-            while (*regList && *regList != ' ')
-                regList++;
-            // skip to next word
-            while (*regList == ' ')
-                regList++;
-            i++;
-        }
-        else return i;
-    }
-
-    return reg_None;
-}
-
-
 // get a word and find a register name
 // regList is a space-separated list of register names
 // GetReg returns:
@@ -1449,22 +2337,257 @@ u_int GetBackslashChar(void)
 
 
 // --------------------------------------------------------------
-// macro handling
+// hash tables
 
 
-MacroPtr FindMacro(char *name)
+/*
+ *  HashStr - FNV-1a hash of a string
+ */
+
+u_int HashStr(const char *s)
 {
-    MacroPtr p = macroTab;
-    bool found = FALSE;
+    u_int h = HASH_INIT;
 
-    while (p && !found)
+    while (*s)
+        h = HASH_STEP(h, *s++);
+
+    return h;
+}
+
+
+HashPtr HashFind(HashTabPtr t, const char *key, u_int hash)
+{
+    HashPtr p;
+
+    if (t -> size == 0) return NULL;
+
+    p = t -> bucket[hash & (t -> size - 1)];
+    while (p && (p -> hash != hash || strcmp(p -> key, key) != 0))
+        p = p -> hnext;
+
+    return p;
+}
+
+
+// same as HashFind, but only the first len chars of key are used
+HashPtr HashFindN(HashTabPtr t, const char *key, int len, u_int hash)
+{
+    HashPtr p;
+
+    if (t -> size == 0) return NULL;
+
+    p = t -> bucket[hash & (t -> size - 1)];
+    while (p && (p -> hash != hash || strncmp(p -> key, key, len) != 0 || p -> key[len] != 0))
+        p = p -> hnext;
+
+    return p;
+}
+
+
+void HashGrow(HashTabPtr t)
+{
+    HashPtr *bucket;
+    HashPtr p,next;
+    u_int   size,i;
+
+    size = t -> size ? t -> size * 2 : 8;
+    bucket = calloc(size, sizeof *bucket);
+
+    // re-link each entry using its stored hash value
+    for (i=0; i < t -> size; i++)
+        for (p = t -> bucket[i]; p; p = next)
+        {
+            next = p -> hnext;
+            p -> hnext = bucket[p -> hash & (size - 1)];
+            bucket[p -> hash & (size - 1)] = p;
+        }
+
+    free(t -> bucket);
+    t -> bucket = bucket;
+    t -> size   = size;
+}
+
+
+// key must already be set in p
+void HashAdd(HashTabPtr t, HashPtr p, u_int hash)
+{
+    if (t -> count >= t -> size)
+        HashGrow(t);
+
+    p -> hash  = hash;
+    p -> hnext = t -> bucket[hash & (t -> size - 1)];
+    t -> bucket[hash & (t -> size - 1)] = p;
+    t -> count++;
+}
+
+
+// p must be in t
+void HashRemove(HashTabPtr t, HashPtr p)
+{
+    HashPtr *q;
+
+    q = &t -> bucket[p -> hash & (t -> size - 1)];
+    while (*q != p)
+        q = &(*q) -> hnext;
+    *q = p -> hnext;
+    t -> count--;
+}
+
+
+// make room for at least n entries without growing again
+void HashReserve(HashTabPtr t, u_int n)
+{
+    while (t -> size < n)
+        HashGrow(t);
+}
+
+
+void HashFree(HashTabPtr t)
+{
+    free(t -> bucket);
+    t -> bucket = NULL;
+    t -> size   = 0;
+    t -> count  = 0;
+}
+
+
+// --------------------------------------------------------------
+// register tables
+
+
+// find a register name by scanning the list
+// regList is a space-separated list of register names
+// ScanReg returns:
+//       -2 (aka reg_EOL) if empty string
+//      -1 (aka reg_None) if no register found
+//      0 if regName is the first register in regList
+//      1 if regName is the second register in regList
+//      etc.
+int ScanReg(const char *regName, const char *regList)
+{
+    const char *p;
+    int i;
+
+    if (!regName[0]) return reg_EOL;
+
+    i = 0;
+    while (*regList)
     {
-        found = (strcmp(p -> name, name) == 0);
-        if (!found)
-            p = p -> next;
+        p = regName;
+        // compare words
+        while (*p && *p == *regList)
+        {
+            regList++;
+            p++;
+        }
+
+        // if not match, skip rest of word
+        if (*p || (*regList != 0 && *regList != ' '))
+        {
+            // skip to next whitespace
+            while (*regList && *regList != ' ')
+                regList++;
+            // skip to next word
+            while (*regList == ' ')
+                regList++;
+            i++;
+        }
+        else return i;
     }
 
-    return p;
+    return reg_None;
+}
+
+
+
+/*
+ *  GetRegTab - find or build the compiled table for a register list
+ *
+ *  Tables are keyed by the address of regList, so the list must not
+ *  change during the run. All of the backends pass static strings.
+ */
+
+RegTabPtr GetRegTab(const char *regList)
+{
+    RegTabPtr   t;
+    RegRecPtr   r;
+    const char  *p;
+    int         len;
+    u_int       hash;
+
+    t = regTabs[REGTAB_HASH(regList)];
+    while (t && t -> list != regList)
+        t = t -> next;
+    if (t) return t;
+
+    t = ArenaAlloc(&permArena, sizeof *t);
+    memset(t, 0, sizeof *t);
+    t -> list = regList;
+
+    for (p = regList; *p; p += len)
+    {
+        while (*p == ' ') p++;
+        for (len = 0; p[len] && p[len] != ' '; len++) ;
+        if (len)
+        {
+            r = ArenaAlloc(&permArena, sizeof *r);
+            r -> h.key = ArenaAlloc(&permArena, len + 1);
+            memcpy(r -> h.key, p, len);
+            r -> h.key[len] = 0;
+            hash = HashStr(r -> h.key);
+            // only the first of any duplicate names is ever found
+            if (HashFind(&t -> names, r -> h.key, hash) == NULL)
+            {
+                // let the scan decide the index, so that odd spacing counts the same
+                r -> reg = ScanReg(r -> h.key, regList);
+                HashAdd(&t -> names, &r -> h, hash);
+            }
+        }
+    }
+
+    t -> next = regTabs[REGTAB_HASH(regList)];
+    regTabs[REGTAB_HASH(regList)] = t;
+
+    return t;
+}
+
+
+// find a register name
+// regList is a space-separated list of register names
+// FindReg returns:
+//       -2 (aka reg_EOL) if empty string
+//      -1 (aka reg_None) if no register found
+//      0 if regName is the first register in regList
+//      1 if regName is the second register in regList
+//      etc.
+int FindReg(const char *regName, const char *regList)
+{
+    const char  *p;
+    RegRecPtr   r;
+    u_int       hash;
+
+    if (!regName[0]) return reg_EOL;
+
+    hash = HASH_INIT;
+    for (p = regName; *p; p++)
+    {
+        // a name with blanks can match across words, so scan for it
+        if (*p == ' ') return ScanReg(regName, regList);
+        hash = HASH_STEP(hash, *p);
+    }
+
+    r = (RegRecPtr) HashFind(&GetRegTab(regList) -> names, regName, hash);
+    return r ? r -> reg : reg_None;
+}
+
+
+// --------------------------------------------------------------
+// macro handling
+
+
+MacroPtr FindMacro(char *name)
+{
+    return (MacroPtr) HashFind(&macroHash, name, HashStr(name));
 }
 
 
@@ -1472,17 +2595,21 @@ MacroPtr NewMacro(char *name)
 {
     MacroPtr    p;
 
-    p = malloc(sizeof *p + strlen(name));
+    p = ArenaAlloc(&asmArena, sizeof *p);
 
     if (p)
     {
-        strcpy(p -> name, name);
+        p -> name    = ArenaStr(&strPool, name);
+        p -> h.key   = p -> name;
         p -> def     = FALSE;
         p -> toomany = FALSE;
         p -> text    = NULL;
         p -> next    = macroTab;
         p -> parms   = NULL;
         p -> nparms  = 0;
+        p -> nlines  = 0;
+        p -> uid     = FALSE;
+        p -> incRef  = NULL;
     }
 
     return p;
@@ -1495,7 +2622,10 @@ MacroPtr AddMacro(char *name)
 
     p = NewMacro(name);
     if (p)
+    {
         macroTab = p;
+        HashAdd(&macroHash, &p -> h, HashStr(name));
+    }
 
     return p;
 }
@@ -1506,9 +2636,9 @@ void AddMacroParm(MacroPtr macro, char *name)
     MacroParmPtr    parm;
     MacroParmPtr    p;
 
-    parm = malloc(sizeof *parm + strlen(name));
+    parm = ArenaAlloc(&asmArena, sizeof *parm);
     parm -> next = NULL;
-    strcpy(parm -> name, name);
+    parm -> name = ArenaStr(&strPool, name);
     macro -> nparms++;
 
     p = macro -> parms;
@@ -1527,11 +2657,14 @@ void AddMacroLine(MacroPtr macro, char *line)
     MacroLinePtr    m;
     MacroLinePtr    p;
 
-    m = malloc(sizeof *m + strlen(line));
+    m = ArenaAlloc(&asmArena, sizeof *m);
     if (m)
     {
         m -> next = NULL;
-        strcpy(m -> text, line);
+        m -> rec  = NULL;
+        m -> text = ArenaStr(&strPool, line);
+        m -> op   = NULL;
+        m -> nop  = 0;
 
         p = macro -> text;
         if (p)
@@ -1561,11 +2694,14 @@ void GetMacParms(MacroPtr macro)
 
     // skip initial whitespace
     c = *linePtr;
-    while (c == 12 || c == '\t' || c == ' ')
+    while (isblank_ff(c))
         c = *++linePtr;
 
     // copy rest of line for safekeeping
-    strcpy(macParmsLine[macLevel], linePtr);
+    if (strlen(linePtr) >= MAX_LINE)
+        Error("Macro parameters too long");
+    strncpy(macParmsLine[macLevel], linePtr, MAX_LINE - 1);
+    macParmsLine[macLevel][MAX_LINE - 1] = 0;
 
     n = 0;
     p = macParmsLine[macLevel];
@@ -1573,7 +2709,7 @@ void GetMacParms(MacroPtr macro)
     {
         // skip whitespace before current parameter
         c = *p;
-        while (c == 12 || c == '\t' || c == ' ')
+        while (isblank_ff(c))
             c = *++p;
 
         // record start of parameter
@@ -1640,134 +2776,223 @@ void GetMacParms(MacroPtr macro)
 }
 
 
-void DoMacParms()
+/*
+ *  MacCompileLine - compile a macro line for the current symbol options
+ *
+ *  The line is scanned the way GetWord would scan it, so only words
+ *  outside of comments are parameters.  Scanning never looks back,
+ *  so the substituted text never needs to be scanned again.
+ */
+
+void MacCompileLine(MacroPtr macro, MacroLinePtr ml)
 {
-    int             i;
-    Str255          word,word2;
+    struct MacOp    op[MAX_LINE];
+    int             nop;
     MacroParmPtr    parm;
+    Str255          word;
+    char            *oldLine;
+    char            *text;
     char            *p;     // pointer to start of word
+    char            *lit;   // start of text not copied yet
     char            c;
+    int             i;
+    int             n;
     int             token;
+    int             len;
+
+    len = strlen(ml -> text);
+    if (len > MAX_LINE - 1)
+        len = MAX_LINE - 1;
+    text = ml -> text;
+    if (text[len])
+    {   // too long, use only what fits in lineBuf[]
+        text = lineBuf;
+        memcpy(text, ml -> text, len);
+        text[len] = 0;
+    }
 
-    // start at beginning of line
-    linePtr = line;
-
-    // skip initial whitespace
-    c = *linePtr;
-    while (c == 12 || c == '\t' || c == ' ')
-        c = *++linePtr;
+    oldLine = linePtr;
+    linePtr = text;
+    lit = text;
+    nop = 0;
 
     // while not end of line
-    p = linePtr;
-    token = GetWord(word);
-    while (token)
+    do
     {
+        // skip initial whitespace
+        c = *linePtr;
+        while (isblank_ff(c))
+            c = *++linePtr;
+
+        p = linePtr;
+        token = LexWord(word);
+        i = -1;     // MOP_ code to add, if any
+        n = 0;      // its parameter number
+
         // if alphanumeric, search for macro parameter of the same name
         if (token == -1)
         {
-            i = 0;
-            parm = macPtr[macLevel] -> parms;
-            while (parm && strcmp(parm -> name, word))
-            {
-                parm = parm -> next;
-                i++;
-            }
-
-            // if macro parameter found, replace parameter name with parameter value
+            for (parm = macro -> parms; parm && strcmp(parm -> name, word); parm = parm -> next)
+                n++;
             if (parm)
-            {
-                // copy from linePtr to temp string
-                strcpy(word, linePtr);
-                // copy from corresponding parameter to p
-                strcpy(p, macParms[i + macLevel * MAXMACPARMS]);
-                // point p to end of appended text
-                p = p + strlen(macParms[i + macLevel * MAXMACPARMS]);
-                // copy from temp to p
-                strcpy(p, word);
-                // update linePtr
-                linePtr = p;
-            }
+                i = MOP_PARM;
         }
         // handle '##' concatenation operator
         else if (token == '#' && *linePtr == '#')
         {
-            p = linePtr + 1;    // skip second '#'
-            linePtr--;          // skip first '#'
-            // skip whitespace to the left
-            while (linePtr > line && linePtr[-1] == ' ')
-                linePtr--;
+            i = MOP_CAT;
+            linePtr++;          // skip second '#'
             // skip whitespace to the right
-            while (*p == ' ') p++;
-            // copy right side of chopped zone
-            strcpy(word, p);
-            // paste it at new linePtr
-            strcpy(linePtr, word);
-            // and linePtr now even points to where it should
+            while (*linePtr == ' ') linePtr++;
         }
-        // handle '\0' number of parameters operator
-        else if (token == '\\' && *linePtr == '0')
+        // handle '\0', '\1' to '\9' and '\?'
+        else if (token == '\\')
         {
-            p = linePtr + 1;    // skip '0'
-            linePtr--;          // skip '\'
-            // make string of number of parameters
-            sprintf(word2, "%d", numMacParms[macLevel]);
-            // copy right side of chopped zone
-            strcpy(word, p);
-            // paste number
-            strcpy(linePtr, word2);
-            linePtr = linePtr + strlen(word2);
-            // paste right side at new linePtr
-            strcpy(linePtr, word);
+            c = *linePtr;
+            if (c == '0')
+                i = MOP_NPARMS;
+            else if ('1' <= c && c <= '9')
+            {
+                i = MOP_PARM;
+                n = c - '1';
+            }
+            else if (c == '?')
+                i = MOP_ID;
+            if (i >= 0)
+                linePtr++;
         }
-        // handle '\n' parameter operator
-        else if (token == '\\' && '1' <= *linePtr && *linePtr <= '9')
+
+        if (i >= 0)
         {
-            i = *linePtr - '1';
-            p = linePtr + 1;    // skip 'n'
-            linePtr--;          // skip '\'
-            // copy right side of chopped zone
-            strcpy(word, p);
-            // paste parameter
-            strcpy(linePtr, macParms[i + macLevel * MAXMACPARMS]);
-            linePtr = linePtr + strlen(macParms[i + macLevel * MAXMACPARMS]);
-            // paste right side at new linePtr
-            strcpy(linePtr, word);
+            if (p > lit)
+            {
+                op[nop].op  = MOP_TEXT;
+                op[nop].src = lit - text;
+                op[nop].end = p - text;
+                nop++;
+            }
+            op[nop].op   = i;
+            op[nop].parm = n;
+            op[nop].src  = p - text;
+            op[nop].end  = linePtr - text;
+            nop++;
+            lit = linePtr;
         }
-        // handle '\?' unique ID operator
-        else if (token == '\\' && *linePtr == '?')
+    } while (token);
+
+    if (*lit)
+    {
+        op[nop].op  = MOP_TEXT;
+        op[nop].src = lit - text;
+        op[nop].end = len;
+        nop++;
+    }
+    linePtr = oldLine;
+
+    ml -> op     = ArenaAlloc(&asmArena, nop * sizeof *op + 1);
+    ml -> nop    = nop;
+    ml -> opOpts = opts & (OPT_ATSYM | OPT_DOLLARSYM);
+    ml -> len    = len;
+    ml -> subst  = text != ml -> text || nop > 1 || (nop == 1 && op[0].op != MOP_TEXT);
+    memcpy(ml -> op, op, nop * sizeof *op);
+}
+
+
+/*
+ *  MacCompile - compile the lines of a macro at its ENDM
+ */
+
+void MacCompile(MacroPtr macro)
+{
+    MacroLinePtr    ml;
+    int             i;
+
+    macro -> nlines = 0;
+    macro -> uid    = FALSE;
+    for (ml = macro -> text; ml; ml = ml -> next)
+    {
+        MacCompileLine(macro, ml);
+        macro -> nlines++;
+        for (i = 0; i < ml -> nop; i++)
+            if (ml -> op[i].op == MOP_ID)
+                macro -> uid = TRUE;
+    }
+}
+
+
+/*
+ *  MacExpand - put a macro line with its parameters substituted in line[]
+ *
+ *  If a substitution would make the line too long, the rest of
+ *  the line is left as it was.
+ */
+
+void MacExpand(MacroLinePtr ml)
+{
+    MacOpPtr    op;
+    MacOpPtr    end;
+    char        *out;
+    char        *s;
+    char        num[16];
+    int         len;
+
+    if (ml -> op == NULL || ml -> opOpts != (opts & (OPT_ATSYM | OPT_DOLLARSYM)))
+        MacCompileLine(macPtr[macLevel], ml);
+
+    if (!ml -> subst)
+    {   // nothing to substitute, use the text in place
+        line = ml -> text;
+        return;
+    }
+
+    line = lineBuf;
+    out = line;
+    end = ml -> op + ml -> nop;
+    for (op = ml -> op; op < end; op++)
+    {
+        switch(op -> op)
         {
-            p = linePtr + 1;    // skip '?'
-            linePtr--;          // skip '\'
-            // make string of number of parameters
-            sprintf(word2, "%.5d", macCurrentID[macLevel]);
-            // copy right side of chopped zone
-            strcpy(word, p);
-            // paste number
-            strcpy(linePtr, word2);
-            linePtr = linePtr + strlen(word2);
-            // paste right side at new linePtr
-            strcpy(linePtr, word);
+            case MOP_TEXT:
+                len = op -> end - op -> src;
+                memcpy(out, ml -> text + op -> src, len);
+                out += len;
+                continue;
+
+            case MOP_CAT:
+                // remove whitespace to the left
+                while (out > line && out[-1] == ' ')
+                    out--;
+                continue;
+
+            case MOP_PARM:
+                s = macParms[op -> parm + macLevel * MAXMACPARMS];
+                break;
+
+            case MOP_NPARMS:
+                sprintf(num, "%d", numMacParms[macLevel]);
+                s = num;
+                break;
+
+            default:
+            case MOP_ID:
+                sprintf(num, "%.5d", macCurrentID[macLevel]);
+                s = num;
+                break;
         }
-/* just use "\##" instead to avoid any confusion with \\ inside of DB pseudo-op
-        // handle '\\' escape
-        else if (token == '\\' && *linePtr == '\\')
+
+        len = strlen(s);
+        if ((out - line) + len + (ml -> len - op -> end) + 1 > MAX_LINE)
         {
-            p = linePtr + 1;    // skip second '\'
-            // copy right side of chopped zone
-            strcpy(word, p);
-            // paste right side at new linePtr
-            strcpy(linePtr, word);
+            Error("Macro line too long");
+            len = ml -> len - op -> src;
+            memcpy(out, ml -> text + op -> src, len);
+            out += len;
+            break;
         }
-*/
-
-        // skip initial whitespace
-        c = *linePtr;
-        while (c == 12 || c == '\t' || c == ' ')
-            c = *++linePtr;
-
-        p = linePtr;
-        token = GetWord(word);
+        memcpy(out, s, len);
+        out += len;
     }
+    *out = 0;
 }
 
 
@@ -1810,6 +3035,52 @@ void DumpMacroTab(void)
 }
 
 
+/*
+ *  MacDefAdd - remember a macro definition of pass 1
+ */
+
+void *GrowTab(void *tab, u_long *max, u_long need, size_t size);
+void MacDefAdd(MacroPtr macro, LinePtr *id, int nlines, char *last, bool addr, bool ok)
+{
+    MacDefPtr   d;
+
+    macDefs = GrowTab(macDefs, &macDefMax, macDefCount + 1, sizeof *macDefs);
+    d = &macDefs[macDefCount++];
+    d -> macro  = macro;
+    d -> id     = id;
+    d -> nlines = nlines;
+    d -> last   = last ? ArenaStr(&strPool, last) : NULL;
+    d -> addr   = addr;
+    d -> ok     = ok;
+}
+
+
+/*
+ *  MacDefFind - find the pass 1 record of a macro definition in pass 2
+ *
+ *  Returns NULL if the body has to be read line by line.  Once a
+ *  definition doesn't match, pass 2 has gone another way and the
+ *  rest of the records are not used.
+ */
+
+MacDefPtr MacDefFind(MacroPtr macro, LinePtr *id)
+{
+    MacDefPtr   d;
+
+    if (pass != 2 || macDefNext >= macDefCount)
+        return NULL;
+
+    d = &macDefs[macDefNext++];
+    if (d -> macro != macro || d -> id != id || id == NULL)
+    {
+        macDefNext = macDefCount;
+        return NULL;
+    }
+
+    return d->ok ? d : NULL;
+}
+
+
 // --------------------------------------------------------------
 // opcodes and symbol table
 
@@ -1850,6 +3121,113 @@ OpcdPtr FindOpcodeTab(OpcdPtr p, char *name, int *typ, int *parm)
 }
 
 
+/*
+ *  IndexOpcodeTab - build the hash index for an opcode table
+ */
+
+OpcdIdxPtr IndexOpcodeTab(OpcdPtr tab)
+{
+    OpcdIdxPtr  x;
+    OpcdHashPtr h;
+    char        *star;
+    int         i,len;
+    u_int       hash;
+
+    // several CPUs can share the same table
+    for (x = opcdIdxTab; x; x = x -> next)
+        if (x -> tab == tab)
+            return x;
+
+    x = ArenaAlloc(&permArena, sizeof *x);
+    memset(x, 0, sizeof *x);
+    x -> tab = tab;
+    x -> minWild = maxOpcdLen;
+
+    for ( ; tab -> name[0]; tab++)
+    {
+        // only the first of any duplicate names is ever found
+        if ((star = strchr(tab -> name, '*')))
+        {
+            len = star - tab -> name;
+            hash = HASH_INIT;
+            for (i = 0; i < len; i++)
+                hash = HASH_STEP(hash, tab -> name[i]);
+            if (HashFindN(&x -> wild, tab -> name, len, hash) == NULL)
+            {
+                h = ArenaAlloc(&permArena, sizeof *h);
+                h -> h.key = ArenaAlloc(&permArena, len + 1);
+                memcpy(h -> h.key, tab -> name, len);
+                h -> h.key[len] = 0;
+                h -> op = tab;
+                HashAdd(&x -> wild, &h -> h, hash);
+                if (len < x -> minWild) x -> minWild = len;
+                if (len > x -> maxWild) x -> maxWild = len;
+            }
+        }
+        else
+        {
+            hash = HashStr(tab -> name);
+            if (HashFind(&x -> names, tab -> name, hash) == NULL)
+            {
+                h = ArenaAlloc(&permArena, sizeof *h);
+                h -> h.key = tab -> name;
+                h -> op = tab;
+                HashAdd(&x -> names, &h -> h, hash);
+            }
+        }
+    }
+
+    x -> next = opcdIdxTab;
+    opcdIdxTab = x;
+
+    return x;
+}
+
+
+/*
+ *  FindOpcodeIdx - same as FindOpcodeTab, using the table's index
+ *
+ *  nameHash is HashStr(name), so that the caller can use it again.
+ */
+
+OpcdPtr FindOpcodeIdx(OpcdIdxPtr x, char *name, u_int nameHash, int *typ, int *parm)
+{
+    OpcdHashPtr h;
+    OpcdPtr     p;
+    u_int       hash;
+    int         i;
+
+    p = NULL;
+    if ((h = (OpcdHashPtr) HashFind(&x -> names, name, nameHash)))
+        p = h -> op;
+
+    // any wildcard entry whose prefix starts the name also matches,
+    // and the first one in the table wins
+    if (x -> wild.count)
+    {
+        hash = HASH_INIT;
+        for (i = 0; ; i++)
+        {
+            if (i >= x -> minWild &&
+                (h = (OpcdHashPtr) HashFindN(&x -> wild, name, i, hash)) &&
+                (p == NULL || h -> op < p))
+                p = h -> op;
+
+            if (name[i] == 0 || i >= x -> maxWild) break;
+            hash = HASH_STEP(hash, name[i]);
+        }
+    }
+
+    if (p)
+    {
+        *typ  = p -> typ;
+        *parm = p -> parm;
+    }
+
+    return p;
+}
+
+
 /*
  *  FindOpcode - finds an opcode in either the generic or CPU-specific
  *               opcode tables, or as a macro name
@@ -1863,15 +3241,19 @@ OpcdPtr GetFindOpcode(char *opcode, int *typ, int *parm, MacroPtr *macro)
 
     OpcdPtr p;
     int len;
+    u_int hash;
 
     p = NULL;
     if (GetOpcode(opcode))
     {
-        if (opcdTab) p = FindOpcodeTab(opcdTab,  opcode, typ, parm);
+        // the name is hashed once for the opcode tables and the macros
+        hash = HashStr(opcode);
+        if (opcdIdx) p = FindOpcodeIdx(opcdIdx,  opcode, hash, typ, parm);
         if (!p)
         {
-            if (opcode[0] == '.') opcode++; // allow pseudo-ops to be invoked as ".OP"
-            p = FindOpcodeTab((OpcdPtr) &opcdTab2, opcode, typ, parm);
+            if (opcode[0] == '.') // allow pseudo-ops to be invoked as ".OP"
+                hash = HashStr(++opcode);
+            p = FindOpcodeIdx(opcdIdx2, opcode, hash, typ, parm);
         }
         if (p)
         {   // if wildcard was matched, back up linePtr
@@ -1885,7 +3267,7 @@ OpcdPtr GetFindOpcode(char *opcode, int *typ, int *parm, MacroPtr *macro)
         }
         else
         {
-            if ((*macro = FindMacro(opcode)))
+            if ((*macro = (MacroPtr) HashFind(&macroHash, opcode, hash)))
             {
                 *typ = o_MacName;
                 p = opcdTab2; // return dummy non-null valid opcode pointer
@@ -1907,17 +3289,7 @@ if (pass == 2 && !strcmp(opcode,"FROB"))
 
 SymPtr FindSym(char *symName)
 {
-    SymPtr p = symTab;
-    bool found = FALSE;
-
-    while (p && !found)
-    {
-        found = (strcmp(p -> name, symName) == 0);
-        if (!found)
-            p = p -> next;
-    }
-
-    return p;
+    return (SymPtr) HashFind(&symHash, symName, HashStr(symName));
 }
 
 
@@ -1925,13 +3297,14 @@ SymPtr FindSym(char *symName)
  *  AddSym
  */
 
-SymPtr AddSym(char *symName)
+SymPtr NewSym(char *symName)
 {
     SymPtr p;
 
-    p = malloc(sizeof *p + strlen(symName));
+    p = ArenaAlloc(&asmArena, sizeof *p);
 
-    strcpy(p -> name, symName);
+    p -> name     = ArenaStr(&strPool, symName);
+    p -> h.key    = p -> name;
     p -> value    = 0;
     p -> next     = symTab;
     p -> defined  = FALSE;
@@ -1939,6 +3312,10 @@ SymPtr AddSym(char *symName)
     p -> isSet    = FALSE;
     p -> equ      = FALSE;
     p -> known    = FALSE;
+    p -> defPass  = 0;
+    p -> incRef   = NULL;
+    p -> equDef   = NULL;
+    p -> equWait  = NULL;
 
     symTab = p;
 
@@ -1946,39 +3323,203 @@ SymPtr AddSym(char *symName)
 }
 
 
+SymPtr AddSym(char *symName)
+{
+    SymPtr p;
+
+    p = NewSym(symName);
+    HashAdd(&symHash, &p -> h, HashStr(symName));
+
+    return p;
+}
+
+
+/*
+ *  local label scopes
+ */
+
+// returns the scope token if symName is a ".name" (or "@name") local label
+int LocalLabel(char *symName)
+{
+    if (symName[0] == '.' && symName[1]) return '.';
+#ifdef TEMP_LBLAT
+    if (symName[0] == '@' && symName[1] && !(opts & OPT_ATSYM)) return '@';
+#endif
+    return 0;
+}
+
+
+void SetLastLabl(char *labl)
+{
+    strcpy(lastLabl,labl);
+    curScope[0] = NULL;
+    curScope[1] = NULL;
+}
+
+
+void SetSubrLabl(char *labl)
+{
+    strcpy(subrLabl,labl);
+    curScope[0] = NULL;
+}
+
+
+// returns the child table of a parent label, i is 0 for '.' and 1 for '@'
+ScopePtr FindScope(int i, char *parent, bool add)
+{
+    u_int       hash;
+    ScopePtr    p;
+
+    hash = HashStr(parent);
+    p = (ScopePtr) HashFind(&scopeHash[i], parent, hash);
+    if (p == NULL && add)
+    {
+        p = ArenaAlloc(&asmArena, sizeof *p);
+        memset(p, 0, sizeof *p);
+        p -> h.key = ArenaStr(&strPool, parent);
+        HashAdd(&scopeHash[i], &p -> h, hash);
+    }
+
+    return p;
+}
+
+
+// returns the child table of the current parent label for a local label token
+ScopePtr GetScope(int token)
+{
+    int         i;
+    char        *parent;
+
+    i = (token != '.');
+    if (curScope[i] == NULL)
+    {
+        if (token == '.' && subrLabl[0])    parent = subrLabl;
+                                    else    parent = lastLabl;
+
+        curScope[i] = FindScope(i, parent, TRUE);
+    }
+
+    return curScope[i];
+}
+
+
+SymPtr FindLocalSym(int token, char *name)
+{
+    ScopePtr    sc;
+
+    // AddScopeSym is only reached in pass 1, but errors show in pass 2
+    sc = GetScope(token);
+    if (strlen(sc -> h.key) + 1 + strlen(name) >= sizeof(Str255))
+        Error("Symbol name too long");
+
+    return (SymPtr) HashFind(&sc -> syms, name, HashStr(name));
+}
+
+
+SymPtr AddScopeSym(ScopePtr scope, int token, char *name)
+{
+    SymPtr      p;
+    Str255      s;
+    int         len;
+
+    // the combined name is only built once, for the listing and error messages
+    // if it is too long, the parent is cut short so that the name still fits
+    len = strlen(scope -> h.key);
+    if (len > (int) sizeof s - 2 - (int) strlen(name))
+        len = sizeof s - 2 - strlen(name);
+    if (len < 0)
+        len = 0;
+    snprintf(s, sizeof s, "%.*s%c%s", len, scope -> h.key, token, name);
+    p = NewSym(s);
+    p -> h.key = p -> name + len + 1;
+    HashAdd(&scope -> syms, &p -> h, HashStr(name));
+
+    return p;
+}
+
+
+SymPtr AddLocalSym(int token, char *name)
+{
+    return AddScopeSym(GetScope(token), token, name);
+}
+
 
 /*
  *  RefSym
  */
 
+void IncRef(SymPtr p);
+void EquMiss(SymPtr p);
+int SymValue(SymPtr p, bool *known)
+{
+    Str255 s;
+
+    symRefs++;
+    if (!p -> defined)
+    {
+        sprintf(s, "Symbol '%s' undefined", p -> name);
+        Error(s);
+    }
+    switch(pass)
+    {
+        case 1:
+            if (!p -> defined)
+            {
+                *known = FALSE;
+                if (equCollect)
+                {
+                    EquMiss(p);
+                    equMissErrs++;
+                }
+            }
+            break;
+        case 2:
+            // after sizing passes, forms were picked from the estimates
+            if (!p -> known && !(cl_Passes > 2 && p -> defined)) *known = FALSE;
+            // a waiting EQU stays unknown up to where pass 1 defined it
+            if (p -> equDef && (!p -> equDef -> done || passLines < p -> equDef -> line))
+                *known = FALSE;
+            break;
+    }
+    if (p -> isSet)
+        evalSet = TRUE;
+    if (incRec)
+        IncRef(p);
+#if 0 // FIXME: possible fix that may be needed for 16-bit address
+    if (addrWid == ADDR_16)
+        return (short) p -> value;    // sign-extend from 16 bits
+#endif
+    return p -> value;
+}
+
+
+int RefLocalSym(int token, char *name, bool *known)
+{
+    SymPtr p;
+
+    if ((p = FindLocalSym(token, name)))
+        return SymValue(p, known);
+
+    p = AddLocalSym(token, name);
+    *known = FALSE;
+    symRefs++;
+    if (equCollect) EquMiss(p);
+
+    return 0;
+}
+
+
 int RefSym(char *symName, bool *known)
 {
     SymPtr p;
     int i;
     Str255 s;
 
+    if ((i = LocalLabel(symName)))
+        return RefLocalSym(i, symName + 1, known);
+
     if ((p = FindSym(symName)))
-    {
-        if (!p -> defined)
-        {
-            sprintf(s, "Symbol '%s' undefined", symName);
-            Error(s);
-        }
-        switch(pass)
-        {
-            case 1:
-                if (!p -> defined) *known = FALSE;
-                break;
-            case 2:
-                if (!p -> known) *known = FALSE;
-                break;
-        }
-#if 0 // FIXME: possible fix that may be needed for 16-bit address
-        if (addrWid == ADDR_16)
-            return (short) p -> value;    // sign-extend from 16 bits
-#endif
-        return p -> value;
-    }
+        return SymValue(p, known);
 
     {   // check for 'FFH' style constants here
 
@@ -1999,6 +3540,8 @@ int RefSym(char *symName, bool *known)
         {
             p = AddSym(symName);
             *known = FALSE;
+            symRefs++;
+            if (equCollect) EquMiss(p);
 //          sprintf(s, "Symbol '%s' undefined", symName);
 //          Error(s);
         }
@@ -2012,34 +3555,77 @@ int RefSym(char *symName, bool *known)
  *  DefSym
  */
 
-void DefSym(char *symName, u_long val, bool setSym, bool equSym)
+void IncDef(SymPtr p, u_long val, bool setSym, bool equSym);
+void EquWake(SymPtr p);
+void DefSymRec(SymPtr p, u_long val, bool setSym, bool equSym)
 {
-    SymPtr p;
     Str255 s;
 
-    if (symName[0]) // ignore null string symName
+    if (!p -> defined || (p -> isSet && setSym))
     {
-        p = FindSym(symName);
-        if (p == NULL)
-            p = AddSym(symName);
-
-        if (!p -> defined || (p -> isSet && setSym))
+        p -> value = val;
+        p -> defined = TRUE;
+        p -> isSet = setSym;
+        p -> equ = equSym;
+        p -> defPass = passNum;
+    }
+    else if (pass == 1 && p -> defPass > 0 && p -> defPass != passNum)
+    {   // a new estimate in a later sizing pass
+        if (p -> value != val)
         {
             p -> value = val;
-            p -> defined = TRUE;
-            p -> isSet = setSym;
-            p -> equ = equSym;
-        }
-        else if (p -> value != val)
-        {
-            p -> multiDef = TRUE;
-            if (pass == 2 && !p -> known)
-                 sprintf(s, "Phase error (%s pass1 val: 0x%x, pass2 val: 0x%x)",symName, p->value, val);
-            else sprintf(s, "Symbol '%s' multiply defined",symName);
-            Error(s);
+            symChanged++;
         }
+        p -> defPass = passNum;
+    }
+    else if (p -> value != val)
+    {
+        p -> multiDef = TRUE;
+        if (pass == 2 && !p -> known)
+             sprintf(s, "Phase error (%s pass1 val: 0x%x, pass2 val: 0x%x)",p->name, p->value, val);
+        else sprintf(s, "Symbol '%s' multiply defined",p->name);
+        Error(s);
+    }
+
+    if (pass == 0 || pass == 2) p -> known = TRUE;
+
+    if (incRec)
+        IncDef(p, val, setSym, equSym);
+
+    if (p -> equWait)
+        EquWake(p);
+}
+
+
+// returns the symbol for a label, adding it if needed
+SymPtr LabelSym(char *symName)
+{
+    SymPtr p;
+    int token;
+
+    if ((token = LocalLabel(symName)))
+    {
+        p = FindLocalSym(token, symName + 1);
+        if (p == NULL)
+            p = AddLocalSym(token, symName + 1);
+    }
+    else
+    {
+        p = FindSym(symName);
+        if (p == NULL)
+            p = AddSym(symName);
+    }
+
+    return p;
+}
 
-        if (pass == 0 || pass == 2) p -> known = TRUE;
+
+void DefSym(char *symName, u_long val, bool setSym, bool equSym)
+{
+    if (symName[0]) // ignore null string symName
+    {
+        symDefCount++;
+        DefSymRec(LabelSym(symName), val, setSym, equSym);
     }
 }
 
@@ -2115,6 +3701,14 @@ void DumpSymTab(void)
     struct  SymRec *p;
     int     i,w;
     Str255  s;
+    char    *buf,*o;
+    int     len;
+
+    if (!cl_List) return;
+
+    // format into a large buffer instead of one fprintf per symbol
+    buf = malloc(DUMPBUF_SIZE);
+    o = buf;
 
     i = 0;
     p = symTab;
@@ -2132,73 +3726,223 @@ void DumpSymTab(void)
             // force a newline if new symbol won't fit on current line
             if (i+w > symTabCols)
             {
-                if (cl_List)
-                    fprintf(listing, "\n");
+                *o++ = '\n';
                 i = 0;
             }
             // if last symbol or if symbol fills line, deblank and print it
             if (p == NULL || i+w >= symTabCols)
             {
                 Debright(s);
-                if (cl_List)
-                    fprintf(listing, "%s\n", s);
+                len = strlen(s);
+                memcpy(o, s, len);
+                o = o + len;
+                *o++ = '\n';
                 i = 0;
             }
             // otherwise just print it and count its width
             else
             {
-                if (cl_List)
-                    fprintf(listing, "%s", s);
+                len = strlen(s);
+                memcpy(o, s, len);
+                o = o + len;
                 i = i + w;
             }
+
+            // flush buffer when there may not be room for another symbol
+            if (o - buf > DUMPBUF_SIZE - 2 * (int) sizeof s)
+            {
+                fwrite(buf, 1, o - buf, listing);
+                o = buf;
+            }
         }
         else p = p -> next;
     }
+
+    fwrite(buf, 1, o - buf, listing);
+    free(buf);
+}
+
+
+/*
+ *  SortSymArray - bottom-up merge sort of an array of symbols by name
+ */
+
+void SortSymArray(SymPtr *a, SymPtr *tmp, int n)
+{
+    SymPtr  *src,*dst,*t;
+    int     width,lo,mid,hi;
+    int     i,j,k;
+
+    src = a;
+    dst = tmp;
+    for (width = 1; width < n; width = width * 2)
+    {
+        for (lo = 0; lo < n; lo = lo + 2 * width)
+        {
+            mid = lo + width;       if (mid > n) mid = n;
+            hi  = lo + 2 * width;   if (hi  > n) hi  = n;
+
+            i = lo; j = mid; k = lo;
+            while (i < mid && j < hi)
+            {
+                if (strcmp(src[i]->name, src[j]->name) <= 0)
+                     dst[k++] = src[i++];
+                else dst[k++] = src[j++];
+            }
+            while (i < mid) dst[k++] = src[i++];
+            while (j < hi)  dst[k++] = src[j++];
+        }
+        t = src; src = dst; dst = t;
+    }
+
+    if (src != a)
+        memcpy(a, src, n * sizeof *a);
 }
 
 
 void SortSymTab()
 {
-    SymPtr          i,j;    // pointers to current elements
-    SymPtr          ip,jp;  // pointers to previous elements
-    SymPtr          t;      // temp for swapping
+    SymPtr  *tab;
+    SymPtr  p;
+    int     n,i;
+
+    n = 0;
+    for (p = symTab; p; p = p -> next)
+        n++;
+    if (n < 2) return;
+
+    tab = malloc(2 * n * sizeof *tab);
+    i = 0;
+    for (p = symTab; p; p = p -> next)
+        tab[i++] = p;
+
+    SortSymArray(tab, tab + n, n);
+
+    // re-link the symbol list in sorted order
+    for (i = 0; i < n-1; i++)
+        tab[i] -> next = tab[i+1];
+    tab[n-1] -> next = NULL;
+    symTab = tab[0];
+
+    free(tab);
+}
+
+
+/*
+ *  ExportSyms - write all defined global symbols to a file
+ *
+ *  The file is plain assembler source ("NAME EQU 0xVALUE" lines), so it
+ *  can be loaded with the -i option or used with INCLUDE.
+ */
+
+void ExportSyms(char *fname)
+{
+    FILE    *f;
+    SymPtr  p;
+
+    f = fopen(fname, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr,"Unable to create symbol export file '%s'!\n",fname);
+        errCount++;
+        return;
+    }
+
+    fprintf(f, "; symbols exported from %s\n", cl_SrcName);
+    for (p = symTab; p; p = p -> next)
+        // skip local labels (their hash key is not the combined name)
+        if (p -> defined && !p -> isSet && p -> h.key == p -> name)
+            fprintf(f, "%s EQU 0x%lX\n", p -> name, p -> value);
+
+    fclose(f);
+}
+
+
+/*
+ *  ImportSyms - bulk load a file written by ExportSyms
+ *
+ *  Each line is "NAME EQU value" (or "NAME = value"), where value is
+ *  decimal, 0x hexadecimal or $ hexadecimal.  Blank lines and lines
+ *  starting with ';' are ignored.
+ */
+
+void ImportSyms(char *fname)
+{
+    FILE    *f;
+    char    *buf,*p,*name,*end;
+    long    size;
+    int     n,lnum;
+    u_long  val;
+
+    f = fopen(fname, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr,"Unable to open symbol import file '%s'!\n",fname);
+        AsmExit(1);
+    }
 
-    // yes, it's a linked-list bubble sort
+    // read the whole file at once
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    size = fread(buf, 1, size, f);
+    buf[size] = 0;
+    fclose(f);
+
+    // size the symbol table once for all lines
+    n = 0;
+    for (p = buf; *p; p++)
+        if (*p == '\n') n++;
+    HashReserve(&symHash, symHash.count + n + 1);
 
-    if (symTab != NULL)
+    lnum = 0;
+    p = buf;
+    while (*p)
     {
-        ip = NULL;  i = symTab;
-        jp = i;     j = i -> next;
+        lnum++;
+        end = p + strcspn(p, "\r\n");
+        if (*end) *end++ = 0;
+        if (*end == '\n') end++;
 
-        while (j != NULL)
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p && *p != ';')
         {
-            while (j != NULL)
+            // symbol name
+            name = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '=') p++;
+            if (*p) *p++ = 0;
+            Uprcase(name);
+
+            // "EQU" or "="
+            while (*p == ' ' || *p == '\t' || *p == '=') p++;
+            if (toupper(p[0]) == 'E' && toupper(p[1]) == 'Q' && toupper(p[2]) == 'U')
+                p = p + 3;
+            while (*p == ' ' || *p == '\t') p++;
+
+            // value
+            if (p[0] == '0' && toupper(p[1]) == 'X')
+                val = strtoul(p + 2, &p, 16);
+            else if (p[0] == '$')
+                val = strtoul(p + 1, &p, 16);
+            else if (isdigit(p[0]))
+                val = strtoul(p, &p, 10);
+            else p = NULL;
+
+            if (p) while (*p == ' ' || *p == '\t') p++;
+            if (name[0] == 0 || p == NULL || (*p && *p != ';'))
             {
-                if (strcmp(i->name,j->name) > 0)    // (i->name > j->name)
-                {
-                    if (ip != NULL) ip -> next = j;
-                               else symTab     = j;
-                    if (i == jp)
-                    {
-                        i -> next = j -> next;
-                        j -> next = i;
-                    }
-                    else
-                    {
-                        jp -> next = i;
-
-                        t         = i -> next;
-                        i -> next = j -> next;
-                        j -> next = t;
-                    }
-                    t = i; i = j; j = t;
-                }
-                jp = j;     j = j -> next;
+                fprintf(stderr,"%s:%d: Invalid symbol definition\n",fname,lnum);
+                AsmExit(1);
             }
-            ip = i;     i = i -> next;
-            jp = i;     j = i -> next;
+
+            DefSym(name, val, FALSE, TRUE);
         }
+
+        p = end;
     }
+
+    free(buf);
 }
 
 
@@ -2209,9 +3953,77 @@ void SortSymTab()
 int Eval0(void);        // forward declaration
 
 
+/*
+ *  ExprEmit - add an operation to the expression being compiled
+ *
+ *  Returns NULL if it is not being compiled.
+ */
+
+ExprOpPtr ExprEmit(int op)
+{
+    ExprOpPtr p;
+
+    if (!exprOn)
+        return NULL;
+
+    if      (op < EX_NEG) exprDepth++;
+    else if (op > EX_HIGH) exprDepth--;
+    if (exprDepth > exprMaxDepth)
+        exprMaxDepth = exprDepth;
+
+    if (exprLen >= MAX_EXPROP || exprMaxDepth > MAX_EXPRSTK)
+    {   // too big, leave it to be parsed every time
+        exprOn = FALSE;
+        return NULL;
+    }
+
+    p = &exprOp[exprLen++];
+    p -> op    = op;
+    p -> token = 0;
+    p -> u.val = 0;
+    return p;
+}
+
+
+void ExprConst(int val)
+{
+    ExprOpPtr p;
+
+    if ((p = ExprEmit(EX_CONST)))
+        p -> u.val = val;
+}
+
+
+// names are copied out of exprNames[] if the code is kept
+void ExprName(int op, int token, char *name)
+{
+    ExprOpPtr p;
+    int     len;
+
+    len = strlen(name) + 1;
+    if (exprNameLen + len > MAX_EXPRNAMES)
+        exprOn = FALSE;
+    if ((p = ExprEmit(op)))
+    {
+        p -> token  = token;
+        p -> u.name = memcpy(exprNames + exprNameLen, name, len);
+        exprNameLen += len;
+    }
+}
+
+
+void ExprSym(SymPtr sym)
+{
+    ExprOpPtr p;
+
+    if ((p = ExprEmit(EX_SYM)))
+        p -> u.sym = sym;
+}
+
+
 int Factor(void)
 {
-    Str255      word,s;
+    Str255      word;
     int         token;
     int         val;
     char        *oldLine;
@@ -2229,6 +4041,7 @@ int Factor(void)
         case '%':
             GetWord(word);
             val = EvalBin(word);
+            ExprConst(val);
             break;
 
         case '$':
@@ -2236,6 +4049,7 @@ int Factor(void)
             {
                 GetWord(word);
                 val = EvalHex(word);
+                ExprConst(val);
                 break;
             }
             // fall-through...
@@ -2246,6 +4060,8 @@ int Factor(void)
             val = (short) val;            // sign-extend from 16 bits
 #endif
             val = val / wordDiv;
+            symRefs++;
+            ExprEmit(EX_LOC);
             break;
 
         case '+':
@@ -2254,22 +4070,27 @@ int Factor(void)
 
         case '-':
             val = -Factor();
+            ExprEmit(EX_NEG);
             break;
 
         case '~':
             val = ~Factor();
+            ExprEmit(EX_NOT);
             break;
 
         case '!':
             val = !Factor();
+            ExprEmit(EX_LNOT);
             break;
 
         case '<':
             val = Factor() & 0xFF;
+            ExprEmit(EX_LOW);
             break;
 
         case '>':
             val = (Factor() >> 8) & 0xFF;
+            ExprEmit(EX_HIGH);
             break;
 
         case '(':
@@ -2293,6 +4114,7 @@ int Factor(void)
                 linePtr++;
             else
                 Error("Missing close quote");
+            ExprConst(val);
 #else
             if ((val = GetBackslashChar()) >= 0)
             {
@@ -2322,6 +4144,14 @@ int Factor(void)
                     {
                         p = FindSym(word);
                         val = (p && (p -> known || pass == 1));
+                        if (pass == 1 && p && !p -> defined)
+                        {
+                            evalKnown = FALSE;  // it may be defined later
+                            equMissLost = TRUE; // and the answer depends on where
+                        }
+                        IncBad();
+                        symRefs++;
+                        ExprName(EX_DEF, 0, word);
                     }
                     else IllegalOperand();
                     break;
@@ -2335,6 +4165,14 @@ int Factor(void)
                     {
                         p = FindSym(word);
                         val = !(p && (p -> known || pass == 1));
+                        if (pass == 1 && p && !p -> defined)
+                        {
+                            evalKnown = FALSE;  // it may be defined later
+                            equMissLost = TRUE; // and the answer depends on where
+                        }
+                        IncBad();
+                        symRefs++;
+                        ExprName(EX_UNDEF, 0, word);
                     }
                     else IllegalOperand();
                     break;
@@ -2343,6 +4181,8 @@ int Factor(void)
                 // invalid ".." operator
                 // rewind and return "current location"
                 linePtr = oldLine;
+                symRefs++;
+                ExprEmit(EX_LOC);
                 break;
             }
 
@@ -2356,6 +4196,8 @@ int Factor(void)
                     val = (short) val;    // sign-extend from 16 bits
 #endif
                 val = val / wordDiv;
+                symRefs++;
+                ExprEmit(EX_LOC);
                 break;
             }
 
@@ -2366,12 +4208,8 @@ int Factor(void)
         case '@':
 #endif
             GetWord(word);
-            if (token == '.' && subrLabl[0])    strcpy(s,subrLabl);
-                                        else    strcpy(s,lastLabl);
-            s[strlen(s)+1] = 0;
-            s[strlen(s)]   = token;
-            strcat(s,word);
-            val = RefSym(s, &evalKnown);
+            val = RefLocalSym(token, word, &evalKnown);
+            ExprName(EX_LOCAL, token, word);
             break;
 
         case -1:
@@ -2384,10 +4222,29 @@ int Factor(void)
                 RParen();           // check for right paren
                 if (token == 'H') val = (val >> 8) & 0xFF;
                 if (token == 'L') val = val & 0xFF;
+                ExprEmit(token == 'H' ? EX_HIGH : EX_LOW);
                 break;
             }
-            if (isdigit(word[0]))   val = EvalNum(word);
-                            else    val = RefSym(word,&evalKnown);
+            if (isdigit(word[0]))
+            {
+                val = EvalNum(word);
+                ExprConst(val);
+            }
+            else if (!LocalLabel(word) && (p = FindSym(word)))
+            {   // the symbol is the handle for the compiled code
+                val = SymValue(p, &evalKnown);
+                ExprSym(p);
+            }
+            else
+            {
+                val = RefSym(word,&evalKnown);
+                if ((token = LocalLabel(word)))
+                    ExprName(EX_LOCAL, token, word + 1);
+                else if ((p = FindSym(word)))
+                    ExprSym(p);
+                else // an 'FFH' constant, until a label of that name is defined
+                    exprOn = FALSE;
+            }
             break;
 
         default:
@@ -2414,7 +4271,9 @@ int Term(void)
     {
         switch(token)
         {
-            case '*':   val = val * Factor();   break;
+            case '*':   val = val * Factor();
+                        ExprEmit(EX_MUL);
+                        break;
             case '/':   val2 = Factor();
                         if (val2)
                             val = val / val2;
@@ -2423,6 +4282,7 @@ int Term(void)
                             Warning("Division by zero");
                             val = 0;
                         }
+                        ExprEmit(EX_DIV);
                         break;
             case '%':   val2 = Factor();
                         if (val2)
@@ -2432,6 +4292,7 @@ int Term(void)
                             Warning("Division by zero");
                             val = 0;
                         }
+                        ExprEmit(EX_MOD);
                         break;
         }
         oldLine = linePtr;
@@ -2458,8 +4319,8 @@ int Eval2(void)
     {
         switch(token)
         {
-            case '+':   val = val + Term();     break;
-            case '-':   val = val - Term();     break;
+            case '+':   val = val + Term();     ExprEmit(EX_ADD);   break;
+            case '-':   val = val - Term();     ExprEmit(EX_SUB);   break;
         }
         oldLine = linePtr;
         token = GetWord(word);
@@ -2488,15 +4349,15 @@ int Eval1(void)
     {
         switch(token)
         {
-            case '<':   if (*linePtr == '=')    {linePtr++; val = (val <= Eval2());}
-                                        else                val = (val <  Eval2());
+            case '<':   if (*linePtr == '=')    {linePtr++; val = (val <= Eval2()); ExprEmit(EX_LE);}
+                                        else                {val = (val <  Eval2()); ExprEmit(EX_LT);}
                         break;
-            case '>':   if (*linePtr == '=')    {linePtr++; val = (val >= Eval2());}
-                                        else                val = (val >  Eval2());
+            case '>':   if (*linePtr == '=')    {linePtr++; val = (val >= Eval2()); ExprEmit(EX_GE);}
+                                        else                {val = (val >  Eval2()); ExprEmit(EX_GT);}
                         break;
             case '=':   if (*linePtr == '=') linePtr++; // allow either one or two '=' signs
-                        val = (val == Eval2());     break;
-            case '!':   linePtr++;  val = (val != Eval2());     break;
+                        val = (val == Eval2());     ExprEmit(EX_EQ);    break;
+            case '!':   linePtr++;  val = (val != Eval2());     ExprEmit(EX_NE);    break;
         }
         oldLine = linePtr;
         token = GetWord(word);
@@ -2524,16 +4385,17 @@ int Eval0(void)
     {
         switch(token)
         {
-            case '&':   if (*linePtr == '&') {linePtr++; val = ((val & Eval1()) != 0);}
-                                        else             val =   val & Eval1();
+            case '&':   if (*linePtr == '&') {linePtr++; val = ((val & Eval1()) != 0); ExprEmit(EX_LAND);}
+                                        else            {val =   val & Eval1();        ExprEmit(EX_AND);}
                         break;
-            case '|':   if (*linePtr == '|') {linePtr++; val = ((val | Eval1()) != 0);}
-                                        else             val =   val | Eval1();
+            case '|':   if (*linePtr == '|') {linePtr++; val = ((val | Eval1()) != 0); ExprEmit(EX_LOR);}
+                                        else            {val =   val | Eval1();        ExprEmit(EX_OR);}
                         break;
             case '^':   val = val ^ Eval1();
+                        ExprEmit(EX_XOR);
                         break;
-            case '<':   linePtr++;  val = val << Eval1();   break;
-            case '>':   linePtr++;  val = val >> Eval1();   break;
+            case '<':   linePtr++;  val = val << Eval1();   ExprEmit(EX_SHL);   break;
+            case '>':   linePtr++;  val = val >> Eval1();   ExprEmit(EX_SHR);   break;
         }
         oldLine = linePtr;
         token = GetWord(word);
@@ -2544,11 +4406,202 @@ int Eval0(void)
 }
 
 
+/*
+ *  ExprFind - get the code of the expression at linePtr
+ *
+ *  Returns NULL if it has not been compiled yet, and starts compiling
+ *  it if it can be kept.
+ */
+
+ExprPtr ExprFind(int kind)
+{
+    ExprPtr e;
+    int     ofs;
+
+    exprOn = FALSE;
+    if (!LINETOK_OK())
+        return NULL;
+
+    // symbol handles are only good for one assembly
+    if (curLine -> exprJob != jobNum)
+    {
+        curLine -> expr    = NULL;
+        curLine -> exprJob = jobNum;
+    }
+
+    ofs = linePtr - line;
+    for (e = curLine -> expr; e; e = e -> next)
+        if (e -> ofs == ofs && e -> kind == kind)
+            return e;
+
+    // an error or warning may come from the expression, then parse it again next time
+    exprOn       = !errFlag && !warnFlag;
+    exprLen      = 0;
+    exprDepth    = 0;
+    exprMaxDepth = 0;
+    exprNameLen  = 0;
+    return NULL;
+}
+
+
+/*
+ *  ExprSave - keep the compiled expression that started at ofs
+ *
+ *  Only the code of expressions that will be evaluated again is kept:
+ *  macro lines, and lines that pass 2 or another sizing pass will
+ *  assemble again instead of reusing their code.
+ */
+
+void ExprSave(int ofs, int kind)
+{
+    ExprPtr e;
+    char    *names;
+    int     i;
+
+    exprOn = FALSE;
+    if (errFlag || warnFlag || exprLen == 0)
+        return;
+    if (!macLineFlag && (pass == 2 || (evalKnown && cl_Passes <= 2)))
+        return;
+
+    names = NULL;
+    if (exprNameLen)
+        names = memcpy(ArenaAlloc(&strPool, exprNameLen), exprNames, exprNameLen);
+
+    e = ArenaAlloc(&asmArena, sizeof *e + (exprLen - 1) * sizeof *e -> op);
+    e -> ofs  = ofs;
+    e -> end  = linePtr - line;
+    e -> kind = kind;
+    e -> nop  = exprLen;
+    memcpy(e -> op, exprOp, exprLen * sizeof *e -> op);
+    for (i = 0; i < exprLen; i++)
+        if (e -> op[i].op == EX_LOCAL || e -> op[i].op == EX_DEF || e -> op[i].op == EX_UNDEF)
+            e -> op[i].u.name = names + (e -> op[i].u.name - exprNames);
+    e -> next = curLine -> expr;
+    curLine -> expr = e;
+    exprCount++;
+}
+
+
+/*
+ *  ExprRun - evaluate a compiled expression
+ *
+ *  Symbols are looked at again, so this gives the same value, errors
+ *  and evalKnown as parsing the expression.
+ */
+
+int ExprRun(ExprPtr e)
+{
+    int         stack[MAX_EXPRSTK];
+    int         *sp;
+    int         i,val;
+    ExprOpPtr   op;
+    SymPtr      p;
+
+    sp = stack;
+    op = e -> op;
+    for (i = e -> nop; i > 0; i--, op++)
+    {
+        switch (op -> op)
+        {
+            case EX_CONST:  *sp++ = op -> u.val;    continue;
+            case EX_LOC:    val = locPtr;
+                            symRefs++;
+                            *sp++ = val / wordDiv;  continue;
+            case EX_SYM:    *sp++ = SymValue(op -> u.sym, &evalKnown);  continue;
+            case EX_LOCAL:  *sp++ = RefLocalSym(op -> token, op -> u.name, &evalKnown); continue;
+
+            case EX_DEF:
+            case EX_UNDEF:
+                p = FindSym(op -> u.name);
+                val = (p && (p -> known || pass == 1));
+                if (pass == 1 && p && !p -> defined)
+                {
+                    evalKnown = FALSE;  // it may be defined later
+                    equMissLost = TRUE; // and the answer depends on where
+                }
+                IncBad();
+                symRefs++;
+                *sp++ = (op -> op == EX_DEF) ? val : !val;
+                continue;
+
+            case EX_NEG:    sp[-1] = -sp[-1];               continue;
+            case EX_NOT:    sp[-1] = ~sp[-1];               continue;
+            case EX_LNOT:   sp[-1] = !sp[-1];               continue;
+            case EX_LOW:    sp[-1] = sp[-1] & 0xFF;         continue;
+            case EX_HIGH:   sp[-1] = (sp[-1] >> 8) & 0xFF;  continue;
+        }
+
+        // binary operators
+        val = *--sp;
+        switch (op -> op)
+        {
+            case EX_MUL:    sp[-1] = sp[-1] * val;  break;
+            case EX_DIV:
+            case EX_MOD:    if (val == 0)
+                            {
+                                Warning("Division by zero");
+                                sp[-1] = 0;
+                            }
+                            else if (op -> op == EX_DIV)
+                                sp[-1] = sp[-1] / val;
+                            else
+                                sp[-1] = sp[-1] % val;
+                            break;
+            case EX_ADD:    sp[-1] = sp[-1] + val;  break;
+            case EX_SUB:    sp[-1] = sp[-1] - val;  break;
+            case EX_LT:     sp[-1] = sp[-1] <  val; break;
+            case EX_LE:     sp[-1] = sp[-1] <= val; break;
+            case EX_GT:     sp[-1] = sp[-1] >  val; break;
+            case EX_GE:     sp[-1] = sp[-1] >= val; break;
+            case EX_EQ:     sp[-1] = sp[-1] == val; break;
+            case EX_NE:     sp[-1] = sp[-1] != val; break;
+            case EX_AND:    sp[-1] = sp[-1] & val;  break;
+            case EX_LAND:   sp[-1] = (sp[-1] & val) != 0;   break;
+            case EX_OR:     sp[-1] = sp[-1] | val;  break;
+            case EX_LOR:    sp[-1] = (sp[-1] | val) != 0;   break;
+            case EX_XOR:    sp[-1] = sp[-1] ^ val;  break;
+            case EX_SHL:    sp[-1] = sp[-1] << val; break;
+            case EX_SHR:    sp[-1] = sp[-1] >> val; break;
+        }
+    }
+
+    exprHits++;
+    return sp[-1];
+}
+
+
 int Eval(void)
 {
+    int     val;
+    int     ofs,kind;
+    ExprPtr e;
+
     evalKnown = TRUE;
 
-    return Eval0();
+    // after the first time, a line's expressions run from their code
+    kind = opts & (OPT_ATSYM | OPT_DOLLARSYM);
+    e = ExprFind(kind);
+    if (e)
+    {
+        linePtr = line + e -> end;
+        val = ExprRun(e);
+    }
+    else if (exprOn)
+    {
+        ofs = linePtr - line;
+        val = Eval0();
+        ExprSave(ofs, kind);
+    }
+    else
+        val = Eval0();
+
+    if (!evalKnown)
+    {
+        lineKnown   = FALSE;
+        passUnknown = TRUE;
+    }
+    return val;
 }
 
 
@@ -2627,60 +4680,417 @@ int EvalLBranch(int instrLen)
 
 
 // --------------------------------------------------------------
-// object file generation
+// EQU dependencies
 
-// record types -- note that 0 and 1 are used directly for .hex
-enum
-{
-    REC_DATA = 0,   // data record
-    REC_XFER = 1,   // transfer address record
-    REC_HEDR = 2,   // header record (must be sent before start of data)
-#ifdef CODE_COMMENTS
-    REC_CMNT = 3    // comment record
-#endif // CODE_COMMENTS
-};
-    u_char  hex_buf[IHEX_SIZE]; // buffer for current line of object data
-    u_long  hex_len;            // current size of object data buffer
-    u_long  hex_base;           // address of start of object data buffer
-    u_long  hex_addr;           // address of next byte in object data buffer
-    u_short hex_page;           // high word of address for intel hex file
-    u_long  bin_eof;            // current end of file when writing binary file
 
-// Intel hex format:
-//
-// :aabbbbccdddd...ddee
-//
-// aa    = record data length (the number of dd bytes)
-// bbbb  = address for this record
-// cc    = record type
-//       00 = data (data is in the dd bytes)
-//       01 = end of file (bbbb is transfer address)
-//       02 = extended segment address record
-//            dddd (two bytes) represents the segment address
-//       03 = Start segment address record
-//            dddd (two bytes) represents the segment of the transfer address
-//       04 = extended linear address record
-//            dddd (two bytes) represents the high address word
-//       05 = Start linear address record
-//            dddd (two bytes) represents the high word of the transfer address
-// dd... = data bytes if record type needs it
-// ee    = checksum byte: add all bytes aa through dd
-//                        and subtract from 256 (2's complement negate)
+/*
+ *  EquMiss - note an undefined symbol used by the EQU being evaluated
+ */
 
-void write_ihex(u_long addr, u_char *buf, u_long len, int rectype)
+void EquMiss(SymPtr p)
 {
-    int i,chksum;
+    if (equMissCount < MAX_EQUMISS)
+        equMiss[equMissCount++] = p;
+    else
+        equMissLost = TRUE;
+}
 
-    if (rectype > REC_XFER) return;
 
-    // if transfer record with long address, write extended address record
-    if (rectype == REC_XFER && (addr & 0xFFFF0000))
-        write_ihex(addr >> 16, buf, 0, 5);
+/*
+ *  EquEval - evaluate an EQU expression and collect the undefined
+ *            symbols it uses in equMiss[]
+ */
 
-    // if data record with long address, write extended address record
-    if (rectype == REC_DATA && (addr >> 16) != hex_page)
-    {
-        write_ihex(addr >> 16, buf, 0, 4);
+int EquEval(void)
+{
+    int val;
+
+    equCollect   = TRUE;
+    equMissCount = 0;
+    equMissLost  = FALSE;
+    equMissErrs  = 0;
+    equErrBase   = errCount;
+    val = Eval();
+    equCollect   = FALSE;
+
+    return val;
+}
+
+
+/*
+ *  EquWait - make a record wait for the symbols in equMiss[]
+ */
+
+void EquWait(EquPtr r)
+{
+    EquWaitPtr  w;
+    int         i;
+
+    r -> need    = ArenaAlloc(&asmArena, equMissCount * sizeof *r -> need);
+    r -> nneed   = equMissCount;
+    r -> waiting = equMissCount;
+    for (i = 0; i < equMissCount; i++)
+    {
+        r -> need[i] = equMiss[i];
+        w = ArenaAlloc(&asmArena, sizeof *w);
+        w -> equ  = r;
+        w -> next = equMiss[i] -> equWait;
+        equMiss[i] -> equWait = w;
+    }
+}
+
+
+/*
+ *  EquDefer - leave an EQU of pass 1 until the symbols it uses are defined
+ *
+ *  Returns TRUE if the symbol waits, FALSE to define it now.  Only
+ *  an expression whose unknown parts are all undefined symbols can
+ *  wait, and only for the first definition of its symbol.
+ */
+
+bool EquDefer(char *labl, char *expr)
+{
+    EquPtr  r;
+    SymPtr  p;
+
+    // an undefined symbol is an error even in pass 1, but only those may wait
+    if (evalKnown || evalSet || warnFlag || equMissLost || equMissCount == 0
+        || errCount - equErrBase > equMissErrs)
+        return FALSE;
+
+    p = LabelSym(labl);
+    if (p -> defined || p -> equDef)
+        return FALSE;
+    symDefCount++;
+
+    r = ArenaAlloc(&asmArena, sizeof *r);
+    r -> sym      = p;
+    r -> loc      = locPtr;
+    r -> opts     = opts;
+    r -> wordDiv  = wordDiv;
+    r -> scope[0] = GetScope('.');
+    r -> scope[1] = GetScope('@');
+    r -> expr     = ArenaAlloc(&strPool, linePtr - expr + 1);
+    memcpy(r -> expr, expr, linePtr - expr);
+    r -> expr[linePtr - expr] = 0;
+    r -> cycle    = NULL;
+    r -> done     = FALSE;
+    r -> mark     = 0;
+    r -> next     = equTab;
+    equTab = r;
+    p -> equDef = r;
+    equDeferred++;
+
+    EquWait(r);
+    return TRUE;
+}
+
+
+/*
+ *  EquResolve - evaluate a waiting EQU again, now that its symbols are defined
+ *
+ *  The expression is evaluated as it was at its line.  If it used
+ *  other undefined symbols, it waits for those.  An error leaves it
+ *  for pass 2.
+ */
+
+void EquResolve(EquPtr r)
+{
+    char        *oldLine;
+    u_long      oldLoc;
+    int         oldOpts,oldDiv,oldErrs;
+    ScopePtr    oldScope[2];
+    bool        oldErr,oldWarn,oldKnown,oldSet,oldLineKnown,oldUnknown;
+    bool        known,ok;
+    int         val;
+
+    if (r -> done || r -> sym -> defined)
+        return;
+
+    oldLine      = linePtr;
+    oldLoc       = locPtr;
+    oldOpts      = opts;
+    oldDiv       = wordDiv;
+    oldErrs      = errCount;
+    oldScope[0]  = curScope[0];
+    oldScope[1]  = curScope[1];
+    oldErr       = errFlag;
+    oldWarn      = warnFlag;
+    oldKnown     = evalKnown;
+    oldSet       = evalSet;
+    oldLineKnown = lineKnown;
+    oldUnknown   = passUnknown;
+
+    linePtr     = r -> expr;
+    locPtr      = r -> loc;
+    opts        = r -> opts;
+    wordDiv     = r -> wordDiv;
+    curScope[0] = r -> scope[0];
+    curScope[1] = r -> scope[1];
+    errFlag     = FALSE;
+    warnFlag    = FALSE;
+    evalSet     = FALSE;
+
+    val   = EquEval();
+    known = evalKnown;
+    ok    = errCount - equErrBase <= equMissErrs && !warnFlag && !evalSet;
+
+    linePtr     = oldLine;
+    locPtr      = oldLoc;
+    opts        = oldOpts;
+    wordDiv     = oldDiv;
+    errCount    = oldErrs;
+    curScope[0] = oldScope[0];
+    curScope[1] = oldScope[1];
+    errFlag     = oldErr;
+    warnFlag    = oldWarn;
+    evalKnown   = oldKnown;
+    evalSet     = oldSet;
+    lineKnown   = oldLineKnown;
+    passUnknown = oldUnknown;
+
+    if (!ok)
+        return;
+
+    if (known)
+    {
+        r -> done = TRUE;
+        r -> line = passLines;
+        equResolved++;
+        DefSymRec(r -> sym, val, FALSE, TRUE);
+    }
+    else if (equMissCount && !equMissLost)
+        EquWait(r);
+}
+
+
+/*
+ *  EquWake - a symbol was defined, so resolve the EQUs waiting only for it
+ *
+ *  Resolving one can define more, they are queued so that a long chain
+ *  is worked through in order instead of by recursion.
+ */
+
+void EquWake(SymPtr p)
+{
+    EquWaitPtr  w;
+    EquPtr      r;
+    u_long      i;
+
+    w = p -> equWait;
+    p -> equWait = NULL;
+
+    // a SET value depends on where it is used, so leave those to pass 2
+    if (pass != 1 || p -> isSet)
+        return;
+
+    for ( ; w; w = w -> next)
+    {
+        r = w -> equ;
+        if (--r -> waiting == 0 && !r -> done)
+        {
+            equQueue = GrowTab(equQueue, &equQueueMax, equQueueCount + 1, sizeof *equQueue);
+            equQueue[equQueueCount++] = r;
+        }
+    }
+
+    if (equBusy)
+        return;
+    equBusy = TRUE;
+    for (i = 0; i < equQueueCount; i++)
+        EquResolve(equQueue[i]);
+    equQueueCount = 0;
+    equBusy = FALSE;
+}
+
+
+/*
+ *  EquVisit - look for loops in the EQUs still waiting after pass 1
+ */
+
+void EquVisit(EquPtr r, EquPtr *path, int depth)
+{
+    EquPtr  q;
+    Str255  s;
+    char    *msg;
+    int     i,j,first,len;
+
+    r -> mark = 1;
+    path[depth] = r;
+    for (i = 0; i < r -> nneed; i++)
+    {
+        q = r -> need[i] -> equDef;
+        if (q == NULL || q -> done || q -> mark == 2)
+            continue;
+        if (q -> mark == 0)
+        {
+            EquVisit(q, path, depth + 1);
+            continue;
+        }
+
+        // q is on the path, so everything from it to here is a loop
+        for (first = depth; path[first] != q; first--)
+            ;
+        strcpy(s, "Circular EQU definition: ");
+        for (j = first; j <= depth; j++)
+        {
+            len = strlen(s);
+            if (len + strlen(path[j] -> sym -> name) > 200)
+            {
+                strcpy(s + len, "... -> ");
+                break;
+            }
+            sprintf(s + len, "%s -> ", path[j] -> sym -> name);
+        }
+        len = strlen(s);
+        strncat(s, q -> sym -> name, 255 - len);
+        msg = ArenaStr(&strPool, s);
+
+        for (j = first; j <= depth; j++)
+            if (path[j] -> cycle == NULL)
+            {
+                path[j] -> cycle = msg;
+                equCycles++;
+            }
+    }
+    r -> mark = 2;
+}
+
+
+/*
+ *  EquLoops - mark the EQUs that can't be resolved because they wait for each other
+ */
+
+void EquLoops(void)
+{
+    EquPtr  r,next,prev;
+    EquPtr  *path;
+
+    // put them in source order, so that a loop is shown from its first line
+    prev = NULL;
+    for (r = equTab; r; r = next)
+    {
+        next = r -> next;
+        r -> next = prev;
+        prev = r;
+    }
+    equTab = prev;
+
+    path = malloc(equDeferred * sizeof *path);
+    if (path == NULL)
+        return;
+    for (r = equTab; r; r = r -> next)
+        if (!r -> done && r -> mark == 0)
+            EquVisit(r, path, 0);
+    free(path);
+}
+
+
+/*
+ *  EquCheck - report an EQU that is part of a loop
+ *
+ *  Returns TRUE if it was reported.
+ */
+
+bool EquCheck(char *labl)
+{
+    SymPtr  p;
+    int     token;
+
+    if (pass != 2 || equCycles == 0)
+        return FALSE;
+
+    if ((token = LocalLabel(labl)))
+        p = FindLocalSym(token, labl + 1);
+    else
+        p = FindSym(labl);
+    if (p == NULL || p -> equDef == NULL || p -> equDef -> cycle == NULL)
+        return FALSE;
+
+    Error(p -> equDef -> cycle);
+    return TRUE;
+}
+
+
+/*
+ *  EquClear - forget the waiting EQUs of the last pass 1
+ */
+
+void EquClear(void)
+{
+    EquPtr  r;
+    int     i;
+
+    for (r = equTab; r; r = r -> next)
+    {
+        r -> sym -> equDef = NULL;
+        for (i = 0; i < r -> nneed; i++)
+            r -> need[i] -> equWait = NULL;
+    }
+    equTab        = NULL;
+    equQueueCount = 0;
+    equBusy       = FALSE;
+    equCycles     = 0;
+    equDeferred   = 0;
+    equResolved   = 0;
+}
+
+
+// --------------------------------------------------------------
+// object file generation
+
+// record types -- note that 0 and 1 are used directly for .hex
+enum
+{
+    REC_DATA = 0,   // data record
+    REC_XFER = 1,   // transfer address record
+    REC_HEDR = 2,   // header record (must be sent before start of data)
+#ifdef CODE_COMMENTS
+    REC_CMNT = 3    // comment record
+#endif // CODE_COMMENTS
+};
+    u_char  hex_buf[IHEX_SIZE]; // buffer for current line of object data
+    u_long  hex_len;            // current size of object data buffer
+    u_long  hex_base;           // address of start of object data buffer
+    u_long  hex_addr;           // address of next byte in object data buffer
+    u_short hex_page;           // high word of address for intel hex file
+    u_long  bin_eof;            // current end of file when writing binary file
+
+// Intel hex format:
+//
+// :aabbbbccdddd...ddee
+//
+// aa    = record data length (the number of dd bytes)
+// bbbb  = address for this record
+// cc    = record type
+//       00 = data (data is in the dd bytes)
+//       01 = end of file (bbbb is transfer address)
+//       02 = extended segment address record
+//            dddd (two bytes) represents the segment address
+//       03 = Start segment address record
+//            dddd (two bytes) represents the segment of the transfer address
+//       04 = extended linear address record
+//            dddd (two bytes) represents the high address word
+//       05 = Start linear address record
+//            dddd (two bytes) represents the high word of the transfer address
+// dd... = data bytes if record type needs it
+// ee    = checksum byte: add all bytes aa through dd
+//                        and subtract from 256 (2's complement negate)
+
+void write_ihex(u_long addr, u_char *buf, u_long len, int rectype)
+{
+    int i,chksum;
+
+    if (rectype > REC_XFER) return;
+
+    // if transfer record with long address, write extended address record
+    if (rectype == REC_XFER && (addr & 0xFFFF0000))
+        write_ihex(addr >> 16, buf, 0, 5);
+
+    // if data record with long address, write extended address record
+    if (rectype == REC_DATA && (addr >> 16) != hex_page)
+    {
+        write_ihex(addr >> 16, buf, 0, 4);
         hex_page = addr >> 16;
     }
 
@@ -2782,6 +5192,7 @@ void write_bin(u_long addr, u_char *buf, u_long len, int rectype)
         if (addr < cl_Binbase)
         {
             buf = buf + cl_Binbase - addr;
+            len = len - (cl_Binbase - addr);
             addr = cl_Binbase;
         }
 
@@ -2930,8 +5341,12 @@ void CodeInit(void)
 }
 
 
+void OneCode(u_char *buf, u_long len);
 void CodeFlush(void)
 {
+    if (onePass)
+        OneCode(NULL, 0);   // the record also ends here in the object file
+
     if (hex_len)
     {
         write_hex(hex_base, hex_buf, hex_len, REC_DATA);
@@ -2975,6 +5390,75 @@ void CodeOut(int byte)
 }
 
 
+void IncCode(u_char *buf, u_long len);
+// same as calling CodeOut for each of len bytes from buf
+void CodeBlock(u_char *buf, u_long len)
+{
+    u_char  *dst;
+    u_long  size;
+    u_long  n;
+
+    if (pass == 2 && incRec)
+        IncCode(buf, len);
+
+    if (pass == 2 && cl_ObjType == OBJ_BIN)
+    {
+        // binary files take any length, so skip the line buffer
+        CodeFlush();
+        write_hex(codPtr, buf, len, REC_DATA);
+        locPtr = locPtr + len;
+        codPtr = codPtr + len;
+        hex_base = codPtr;
+        hex_addr = codPtr;
+    }
+    else if (pass == 2)
+    {
+        if (cl_ObjType == OBJ_TRSDOS)
+        {
+            dst  = trs_buf;
+            size = sizeof trs_buf;
+        }
+        else
+        {
+            dst  = hex_buf;
+            size = IHEX_SIZE;
+        }
+
+        while (len)
+        {
+            if (codPtr != hex_addr)
+            {
+                CodeFlush();
+                hex_base = codPtr;
+                hex_addr = codPtr;
+            }
+
+            n = size - hex_len;
+            if (n > len)
+                n = len;
+            memcpy(dst + hex_len, buf, n);
+            hex_len  = hex_len  + n;
+            hex_addr = hex_addr + n;
+            buf = buf + n;
+            len = len - n;
+
+            locPtr = locPtr + n;
+            codPtr = codPtr + n;
+
+            if (hex_len == size)
+                CodeFlush();
+        }
+    }
+    else
+    {
+        if (onePass)
+            OneCode(buf, len);
+        locPtr = locPtr + len;
+        codPtr = codPtr + len;
+    }
+}
+
+
 void CodeHeader(char *s)
 {
     CodeFlush();
@@ -3346,13 +5830,13 @@ SegPtr AddSeg(char *name)
 {
     SegPtr  p;
 
-    p = malloc(sizeof *p + strlen(name));
+    p = ArenaAlloc(&asmArena, sizeof *p);
 
     p -> next = segTab;
 //  p -> gen = TRUE;
     p -> loc = 0;
     p -> cod = 0;
-    strcpy(p -> name, name);
+    p -> name = ArenaStr(&strPool, name);
 
     segTab = p;
 
@@ -3362,6 +5846,7 @@ SegPtr AddSeg(char *name)
 
 void SwitchSeg(SegPtr seg)
 {
+    IncBad();   // -u only keeps one code pointer
     CodeFlush();
     curSeg -> cod = codPtr;
     curSeg -> loc = locPtr;
@@ -3376,124 +5861,408 @@ void SwitchSeg(SegPtr seg)
 // text I/O
 
 
-int OpenInclude(char *fname)
+/*
+ *  CondIndex - find the lines a failed IF block can't pass over
+ *
+ *  Any line whose first or second word starts like IF, ELSE, ELSIF
+ *  or ENDIF may be one of them, whatever the label and the CPU.  The
+ *  lines before the next such line are only ignored in a failed IF
+ *  block, except that a label still becomes the last label.
+ */
+
+void CondIndex(SrcPtr p)
 {
-    if (nInclude == MAX_INCLUDE - 1)
-        return -1;
+    char    *s;
+    char    w[6];
+    int     n,i,k;
+    bool    cond;
 
-    nInclude++;
-    include[nInclude] = NULL;
-    incline[nInclude] = 0;
-    strcpy(incname[nInclude],fname);
-    include[nInclude] = fopen(fname, "r");
-    if (include[nInclude])
-        return 1;
+    p -> condNext  = malloc((p -> nlines + 2) * sizeof *p -> condNext);
+    p -> labelLine = malloc((p -> nlines + 1) * sizeof *p -> labelLine);
+    if (p -> condNext == NULL || p -> labelLine == NULL)
+    {
+        fprintf(stderr,"Out of memory reading '%s'\n", p -> name);
+        AsmExit(1);
+    }
 
-    nInclude--;
-    return 0;
-}
+    p -> labelLine[0] = 0;
+    for (n = 1; n <= p -> nlines; n++)
+    {
+        s = p -> text + p -> lineOfs[n];
+        while (*s == 12)
+            s++;
 
+        p -> labelLine[n] = p -> labelLine[n - 1];
+        if (isalphaul(*s) || *s == '$' || *s == '.' || *s == '@')
+            p -> labelLine[n] = n;
 
-void CloseInclude(void)
-{
-    if (nInclude < 0)
-        return;
+        // a '.' before the opcode is allowed, so it separates words here
+        cond = FALSE;
+        for (k = 0; k < 2 && !cond; k++)
+        {
+            while (*s && *s != ';' && !(CharClass(*s) & (CC_ALNUM | CC_DOLLAR | CC_AT)))
+                s++;
+            for (i = 0; i < 5 && (CharClass(s[i]) & (CC_ALNUM | CC_DOLLAR | CC_AT)); i++)
+                w[i] = ToUpper(s[i]);
+            w[i] = 0;
+            cond = strncmp(w, "IF", 2) == 0 || strncmp(w, "ELS", 3) == 0 || strcmp(w, "ENDIF") == 0;
+            while (CharClass(*s) & (CC_ALNUM | CC_DOLLAR | CC_AT))
+                s++;
+        }
+        p -> condNext[n] = cond;
+    }
 
-    fclose(include[nInclude]);
-    include[nInclude] = NULL;
-    nInclude--;
+    p -> condNext[p -> nlines + 1] = p -> nlines + 1;
+    for (n = p -> nlines; n > 0; n--)
+        if (!p -> condNext[n])
+            p -> condNext[n] = p -> condNext[n + 1];
+        else
+            p -> condNext[n] = n;
 }
 
 
-int ReadLine(FILE *file, char *line, int max)
+/*
+ *  LoadSrc - read a whole source file into memory
+ *
+ *  The line ends (LF, CR LF or a lone CR) are overwritten with nulls,
+ *  so that each line can be used in place without copying it.
+ */
+
+bool LoadSrc(SrcPtr p)
 {
-    int c = 0;
-    int len = 0;
+    FILE    *f;
+    long    size;
+    char    *s;
+    char    *end;
+    int     n;
 
-    macLineFlag = TRUE;
+    f = fopen(p -> name, "rb");
+    if (f == NULL)
+        return FALSE;
 
-    // if at end of macro and inside a nested macro, pop the stack
-    while (macLevel > 0 && macLine[macLevel] == NULL)
+    size = -1;
+    if (fseek(f, 0, SEEK_END) == 0)
+        size = ftell(f);
+    if (size < 0 || fseek(f, 0, SEEK_SET) != 0)
     {
-#ifdef ENABLE_REP
-        if (macRepeat[macLevel] > 0)
-        {
-            if (macRepeat[macLevel]--)
-                macLine = macPtr[macLevel] -> text;
-            else
-            {
-                free(macPtr[macLevel]);
-                macLevel--;
-            }
-        }
-        else
-#endif
-        macLevel--;
+        fclose(f);
+        return FALSE;
     }
 
-    // if there is still another macro line to process, get it
-    if (macLine[macLevel] != NULL)
+    p -> text = malloc(size + 1);
+    if (p -> text == NULL)
     {
-        strcpy(line, macLine[macLevel] -> text);
-        macLine[macLevel] = macLine[macLevel] -> next;
-        DoMacParms();
+        fprintf(stderr,"Out of memory reading '%s'\n", p -> name);
+        AsmExit(1);
     }
-    else
-    {   // else we weren't in a macro or we just ran out of macro
-        macLineFlag = FALSE;
+    size = fread(p -> text, 1, size, f);
+    fclose(f);
+    p -> text[size] = 0;
+    p -> size = size;
 
-        if (nInclude >= 0)
-            incline[nInclude]++;
-        else
-            linenum++;
+    // count the lines, the last one need not have a line end
+    end = p -> text + size;
+    n = 0;
+    for (s = p -> text; s < end; s++)
+        if (*s == '\n' || (*s == '\r' && s[1] != '\n'))
+            n++;
+    if (size > 0 && end[-1] != '\n' && end[-1] != '\r')
+        n++;
 
-        macPtr[macLevel] = NULL;
+    p -> nlines  = n;
+    p -> lineOfs = malloc((n + 1) * sizeof *p -> lineOfs);
+    p -> lines   = calloc(n + 1, sizeof *p -> lines);
+    if (p -> lineOfs == NULL || p -> lines == NULL)
+    {
+        fprintf(stderr,"Out of memory reading '%s'\n", p -> name);
+        AsmExit(1);
+    }
 
-        while (max > 1)
+    // lines are numbered from 1
+    n = 1;
+    s = p -> text;
+    while (n <= p -> nlines)
+    {
+        p -> lineOfs[n++] = s - p -> text;
+        while (*s != '\n' && *s != '\r' && s < end)
+            s++;
+        if (*s == '\r' && s[1] == '\n')
+            *s++ = 0;
+        *s++ = 0;
+    }
+
+    CondIndex(p);
+    return TRUE;
+}
+
+
+// bytes malloc'ed by LoadSrc
+u_long SrcSize(SrcPtr p)
+{
+    return p -> size + 1 + (p -> nlines + 1) * (sizeof *p -> lineOfs + sizeof *p -> lines)
+                         + (2 * p -> nlines + 3) * sizeof *p -> condNext;
+}
+
+
+/*
+ *  SrcKey - make the srcHash key and stamp for a file
+ *
+ *  Device and inode numbers are used where the system has them, so
+ *  that different paths to the same file share one copy.  The stamp
+ *  of size and modification time tells when that copy is out of date.
+ */
+
+void SrcKey(char *key, char *stamp, char *fname, struct stat *st)
+{
+    if (st -> st_ino)
+        sprintf(key, "%lx:%lx", (u_long) st -> st_dev, (u_long) st -> st_ino);
+    else
+        sprintf(key, "%.200s", fname);
+    sprintf(stamp, "%lx:%lx", (u_long) st -> st_size, (u_long) st -> st_mtime);
+#ifdef __linux__
+    // a server may see a file again after a change in the same second
+    sprintf(stamp + strlen(stamp), ".%lx", (u_long) st -> st_mtim.tv_nsec);
+#endif
+}
+
+
+/*
+ *  FindSrc - find or read the record for a source file
+ *
+ *  Returns NULL if the file can not be read.
+ */
+
+SrcPtr FindSrc(char *fname)
+{
+    SrcNamePtr  n;
+    SrcPtr      p;
+    struct SrcRec src;
+    struct stat st;
+    Str255      key,stamp;
+    u_int       hash;
+
+    hash = HashStr(fname);
+    n = (SrcNamePtr) HashFind(&srcNames, fname, hash);
+    if (n)
+    {
+        srcHits++;
+        return n -> src;
+    }
+
+    if (stat(fname, &st) != 0 || S_ISDIR(st.st_mode))
+        return NULL;
+
+    SrcKey(key, stamp, fname, &st);
+    p = (SrcPtr) HashFind(&srcHash, key, HashStr(key));
+    if (p && strcmp(p -> stamp, stamp) == 0)
+        srcHits++;
+    else
+    {
+        src.name      = fname;
+        src.text      = NULL;
+        src.lineOfs   = NULL;
+        src.condNext  = NULL;
+        src.labelLine = NULL;
+        src.lines     = NULL;
+        src.nlines    = 0;
+        src.size      = 0;
+        src.sum[0]    = 0;
+        if (!LoadSrc(&src))
+            return NULL;
+        srcBytes = srcBytes + SrcSize(&src);
+
+        // the file has changed, but this job may still use the old lines
+        if (p)
         {
-            c = fgetc(file);
-            *line = 0;
-            switch(c)
-            {
-                case EOF:
-                    if (len == 0) return 0;
-                case '\n':
-                    return 1;
-                case '\r':
-                    c = fgetc(file);
-                    if (c != '\n')
-                    {
-                        ungetc(c,file);
-                        c = '\r';
-                    }
-                    return 1;
-                default:
-                    *line++ = c;
-                    max--;
-                    len++;
-                    break;
-            }
+            HashRemove(&srcHash, &p -> h);
+            p -> h.hnext = (HashPtr) srcOld;
+            srcOld = p;
+        }
+
+        p = ArenaAlloc(&lineArena, sizeof *p);
+        *p = src;
+        p -> h.key = ArenaStr(&lineArena, key);
+        p -> stamp = ArenaStr(&lineArena, stamp);
+        p -> name  = ArenaStr(&lineArena, fname);
+        HashAdd(&srcHash, &p -> h, HashStr(key));
+        srcMisses++;
+    }
+
+    // names are relative to the current directory, so only kept for one assembly
+    n = ArenaAlloc(&asmArena, sizeof *n);
+    n -> h.key = strcmp(p -> name, fname) ? ArenaStr(&strPool, fname) : p -> name;
+    n -> src   = p;
+    HashAdd(&srcNames, &n -> h, hash);
+
+    return p;
+}
+
+
+int OpenInclude(char *fname)
+{
+    SrcPtr  p;
+
+    if (nInclude == MAX_INCLUDE - 1)
+        return -1;
+
+    p = FindSrc(fname);
+    if (p == NULL)
+        return 0;
+
+    nInclude++;
+    incline[nInclude] = 0;
+    strcpy(incname[nInclude],fname);
+    incSrc[nInclude] = p;
+    return 1;
+}
+
+
+void IncEnd(void);
+void CloseInclude(void)
+{
+    if (nInclude < 0)
+        return;
+
+    if (nInclude == 0 && incRec)
+        IncEnd();
+    nInclude--;
+}
+
+
+/*
+ *  CondSkip - pass over lines of a failed IF block
+ *
+ *  The lines from n up to the next one that may be an IF, ELSE,
+ *  ELSIF or ENDIF are not listed and don't make code, so they are
+ *  not read.  The last of them with a label still sets it as the
+ *  last label.  Returns the number of the next line to read.
+ */
+
+bool GetLabel(char *labl);
+int CondSkip(SrcPtr src, int n)
+{
+    Str255  labl;
+    int     next;
+    int     i;
+
+    next = src -> condNext[n];
+    if (next == n)
+        return n;
+
+    for (i = src -> labelLine[next - 1]; i >= n; i = src -> labelLine[i - 1])
+    {
+        line = src -> text + src -> lineOfs[i];
+        lineLen = strlen(line);
+        if (GetLabel(labl))
+        {
+            SetLastLabl(labl);
+            break;
+        }
+    }
+
+    passLines   = passLines + (next - n);
+    condSkipped = condSkipped + (next - n);
+    condJumps++;
+    return next;
+}
+
+
+bool LoopNext(void);
+int ReadLine(SrcPtr src, int *lineNum)
+{
+    MacroLinePtr ml;
+    int n;
+
+    macLineFlag = TRUE;
+
+    // if at end of macro and inside a nested macro, pop the stack,
+    // the end of a loop starts it over until it is done
+    while (macLine[macLevel] == NULL && (macLevel > 0 || loopTab[0].kind))
+    {
+        if (loopTab[macLevel].kind && loopTab[macLevel].body -> text == NULL)
+            loopTab[macLevel].kind = LOOP_NONE; // no body to start again
+        if (loopTab[macLevel].kind && LoopNext())
+            break;
+        if (macLevel == 0)
+            break;
+        macLevel--;
+    }
+
+    // if there is still another macro line to process, get it
+    if (macLine[macLevel] != NULL)
+    {
+        ml = macLine[macLevel];
+        macLine[macLevel] = ml -> next;
+        lineId = &ml -> rec;
+        if ((memoCur = memoNext[macLevel]))
+        {   // the same line as a kept expansion, DoLine won't look at it
+            memoNext[macLevel]++;
+            line = memoCur -> text;
+            lineLen = strlen(line);
+            return 1;
+        }
+        MacExpand(ml);
+        lineLen = strlen(line);
+
+        // the text only stays the same if nothing was substituted
+        if (!ml -> subst)
+            lineSlot = &ml -> rec;
+    }
+    else
+    {   // else we weren't in a macro or we just ran out of macro
+        macLineFlag = FALSE;
+        macPtr[macLevel] = NULL;
+
+        n = ++*lineNum;
+        if (condSkip && n <= src -> nlines)
+            n = *lineNum = CondSkip(src, n);
+        if (n > src -> nlines)
+        {
+            line = lineBuf;
+            line[0] = 0;
+            lineLen = 0;
+            return 0;
         }
-        while (c != EOF && c != '\n')
-            c = fgetc(file);
+
+        // use the line in place, both passes read the same text
+        line = src -> text + src -> lineOfs[n];
+        lineLen = strlen(line);
+        spanText = src -> text;
+        spanEnd  = src -> text + src -> size + 1;
+        lineSlot = &src -> lines[n];
+        lineId   = lineSlot;
     }
     return 1;
 }
 
 
-int ReadSourceLine(char *line, int max)
+int ReadSourceLine(void)
 {
     int i;
 
+    // line[] is about to change, macro lines go away with their macro
+    if (curLine == &newLine)
+        *lineSlot = SaveLine(macLineFlag ? &asmArena : &lineArena);
+    curLine  = NULL;
+    lineSlot = NULL;
+    lineId   = NULL;
+    memoCur  = NULL;
+
     while (nInclude >= 0)
     {
-        i = ReadLine(include[nInclude], line, max);
-        if (i) return i;
+        i = ReadLine(incSrc[nInclude], &incline[nInclude]);
+        if (i)
+        {
+            condSkip = FALSE;
+            return i;
+        }
 
         CloseInclude();
     }
 
-    return ReadLine(source, line, max);
+    i = ReadLine(srcMain, &linenum);
+    condSkip = FALSE;
+    return i;
 }
 
 
@@ -3505,42 +6274,1676 @@ void ListOut(bool showStdErr)
 */
     Debright(listLine);
 
-    if (cl_List)
-        fprintf(listing,"%s\n",listLine);
+    if (cl_List)
+        fprintf(listing,"%s\n",listLine);
+
+    if (pass == 2 && showStdErr && ((errFlag && cl_Err) || (warnFlag && cl_Warn)))
+        fprintf(stderr,"%s\n",listLine);
+}
+
+
+void CopyListLine(void)
+{
+    int n;
+    char c,*p,*q;
+
+    p = listLine;
+    q = line;
+    listLineFF = FALSE;
+
+    // the old version
+//  strcpy(listLine, "                ");       // 16 blanks
+//  strncat(listLine, line, 255-16);
+
+    if (listWid == LIST_24)
+        for (n=24; n; n--) *p++ = ' ';  // 24 blanks at start of line
+    else
+        for (n=16; n; n--) *p++ = ' ';  // 16 blanks at start of line
+
+    while (n < 255-16 && (c = *q++))    // copy rest of line, stripping out form feeds
+    {
+        if (c == 12) listLineFF = TRUE; // if a form feed was found, remember it for later
+        else
+        {
+            *p++ = c;
+            n++;
+        }
+    }
+    *p = 0;   // string terminator
+}
+
+
+// --------------------------------------------------------------
+// line reuse
+
+
+/*
+ *  IrLine - get the pass 1 record for the line about to be assembled
+ *
+ *  Pass 1 adds a new record.  Pass 2 gets the next record if it was
+ *  for the same line in the same state.  Otherwise the passes went
+ *  different ways, and no more lines are reused in this pass.
+ */
+
+IrPtr IrLine(void)
+{
+    IrPtr   ir;
+    bool    active;
+
+    active = (condState[condLevel] & condTRUE) != 0;
+
+    if (pass == 1)
+    {
+        if (irCount == irMax)
+        {
+            irMax = irMax ? irMax * 2 : 1024;
+            irTab = realloc(irTab, irMax * sizeof *irTab);
+            if (irTab == NULL)
+            {
+                fprintf(stderr,"Out of memory\n");
+                AsmExit(1);
+            }
+        }
+
+        ir = &irTab[irCount++];
+        ir -> id        = lineId;
+        ir -> loc       = locPtr;
+        ir -> cpu       = curCpuRec;
+        ir -> active    = active;
+        ir -> len       = 0;
+        ir -> hexSpaces = 0;
+        ir -> code      = NULL;
+        return ir;
+    }
+
+    if (irStop || irNext >= irCount)
+    {
+        irStop = TRUE;
+        return NULL;
+    }
+
+    ir = &irTab[irNext++];
+    if (ir -> id != lineId || ir -> loc != locPtr || ir -> cpu != curCpuRec || ir -> active != active)
+    {
+        irStop = TRUE;
+        return NULL;
+    }
+
+    return ir;
+}
+
+
+/*
+ *  IrSave - keep the code of an instruction or data line from pass 1
+ *
+ *  Only lines that used no forward references, gave no errors or
+ *  warnings and did nothing but make code are kept.  Symbol values
+ *  known in pass 1 are not changed by pass 2 (a change is a phase
+ *  error), so these lines will make the same code again.  defs is
+ *  symDefCount from before the opcode was done.
+ */
+
+void IrSave(IrPtr ir, int defs)
+{
+    int len;
+
+    if (ir == NULL)
+        return;
+
+    if (!lineKnown || lineFixed)
+    {
+        // something other than code may now be different in pass 2
+        if (instrLen == 0 || symDefCount != defs)
+            irStop = TRUE;
+        return;
+    }
+
+    if (irStop || errFlag || warnFlag || instrLen == 0 || symDefCount != defs
+               || locPtr != ir -> loc || curCpuRec != ir -> cpu)
+        return;
+
+    len = abs(instrLen);
+    ir -> len       = instrLen;
+    ir -> hexSpaces = hexSpaces;
+    ir -> code      = ArenaAlloc(&asmArena, len);
+    memcpy(ir -> code, bytStr, len);
+}
+
+
+// --------------------------------------------------------------
+// macro expansion reuse
+
+
+/*
+ *  MemoStop - the expansion being kept used more than its parameters
+ */
+
+void MemoStop(void)
+{
+    if (memoRec)
+        memoRec -> state = MEMO_BAD;
+    memoRec = NULL;
+}
+
+
+/*
+ *  MemoStart - look for a kept expansion of the macro just invoked
+ *
+ *  The key is the macro name and its parameters.  A kept expansion
+ *  is only used after a second one at another address made the same
+ *  lines, because a CPU module can use locPtr without an expression.
+ *  Otherwise this expansion is kept or checked as its lines are done.
+ */
+
+void MemoStart(MacroPtr macro)
+{
+    char        key[MAX_LINE * 2];
+    char        *p;
+    char        *parm;
+    int         i,len;
+    u_int       hash;
+    MemoPtr     m;
+
+    memoNext[macLevel] = NULL;
+    if (incRec || macro -> uid || macro -> nlines == 0)
+        return;
+
+    len = strlen(macro -> name);
+    memcpy(key, macro -> name, len);
+    p = key + len;
+    for (i = 0; i < numMacParms[macLevel]; i++)
+    {
+        parm = macParms[i + macLevel * MAXMACPARMS];
+        len = strlen(parm);
+        *p++ = '\n';
+        memcpy(p, parm, len);
+        p = p + len;
+    }
+    *p = 0;
+
+    hash = HashStr(key);
+    m = (MemoPtr) HashFind(&memoHash, key, hash);
+    if (m == NULL)
+    {
+        m = ArenaAlloc(&asmArena, sizeof *m);
+        m -> h.key = ArenaStr(&strPool, key);
+        m -> lines = ArenaAlloc(&asmArena, macro -> nlines * sizeof *m -> lines);
+        HashAdd(&memoHash, &m -> h, hash);
+    }
+    else if (m -> gen == memoGen && m -> opts == opts)
+    {
+        if (m -> state == MEMO_OK)
+        {
+            memoNext[macLevel] = m -> lines;
+            memoHits++;
+        }
+        else if (m -> state == MEMO_ONCE && m -> loc != locPtr)
+        {
+            memoRec   = m;
+            memoLevel = macLevel;
+            memoCount = 0;
+        }
+        return;
+    }
+
+    // keep this one
+    m -> state = MEMO_NEW;
+    m -> gen   = memoGen;
+    m -> opts  = opts;
+    m -> loc   = locPtr;
+    memoRec   = m;
+    memoLevel = macLevel;
+    memoCount = 0;
+}
+
+
+/*
+ *  MemoAdd - keep or check a line of the expansion
+ *
+ *  ok is FALSE for anything but an instruction or data line.  defs
+ *  and refs are symDefCount and symRefs from before the line.
+ */
+
+void MemoAdd(bool ok, int defs, u_long refs)
+{
+    MemoLinePtr m;
+    int         len;
+
+    if (!ok || errFlag || warnFlag || !lineKnown || lineFixed || symDefCount != defs
+            || symRefs != refs || memoGen != memoRec -> gen)
+    {
+        MemoStop();
+        return;
+    }
+
+    len = abs(instrLen);
+    m = &memoRec -> lines[memoCount++];
+    if (memoRec -> state == MEMO_NEW)
+    {
+        m -> text      = (line == lineBuf) ? ArenaStr(&strPool, line) : line;
+        m -> code      = len ? memcpy(ArenaAlloc(&asmArena, len), bytStr, len) : NULL;
+        m -> len       = instrLen;
+        m -> hexSpaces = hexSpaces;
+        m -> addr      = showAddr;
+    }
+    else if (m -> len != instrLen || m -> hexSpaces != hexSpaces || m -> addr != showAddr
+                || (len && memcmp(m -> code, bytStr, len) != 0) || strcmp(m -> text, line) != 0)
+    {   // the code depends on where it is
+        MemoStop();
+        return;
+    }
+
+    if (memoCount == macPtr[memoLevel] -> nlines)
+    {
+        if (memoRec -> state == MEMO_NEW)
+            memoRec -> state = MEMO_ONCE;
+        else
+        {
+            memoRec -> state = MEMO_OK;
+            memoKept++;
+        }
+        memoRec = NULL;
+    }
+}
+
+
+// --------------------------------------------------------------
+// single pass
+
+
+/*
+ *  GrowTab - make room for need entries in a malloc'ed table
+ */
+
+void *GrowTab(void *tab, u_long *max, u_long need, size_t size)
+{
+    if (need > *max)
+    {
+        *max = *max ? *max * 2 : 1024;
+        if (*max < need)
+            *max = need;
+        tab = realloc(tab, *max * size);
+        if (tab == NULL)
+        {
+            fprintf(stderr,"Out of memory\n");
+            AsmExit(1);
+        }
+    }
+    return tab;
+}
+
+
+/*
+ *  OneFail - give up on -q and leave the object code to pass 2
+ */
+
+void OneFail(void)
+{
+    onePass = FALSE;
+
+    free(oneCode);
+    free(runTab);
+    free(fixTab);
+    oneCode  = NULL;
+    runTab   = NULL;
+    fixTab   = NULL;
+    oneLen   = 0;
+    oneMax   = 0;
+    runCount = 0;
+    runMax   = 0;
+    fixCount = 0;
+    fixMax   = 0;
+}
+
+
+/*
+ *  OneCode - keep len bytes of pass 1 object code at codPtr
+ *
+ *  A len of 0 marks where CodeFlush ended the object record.
+ */
+
+void OneCode(u_char *buf, u_long len)
+{
+    RunPtr  r;
+
+    r = runCount ? &runTab[runCount - 1] : NULL;
+
+    if (len == 0)
+    {
+        if (r == NULL || r -> len == 0)
+            return;
+    }
+    else if (r && r -> len && r -> cod + r -> len == codPtr)
+    {   // continues the last run
+        oneCode = GrowTab(oneCode, &oneMax, oneLen + len, 1);
+        memcpy(oneCode + oneLen, buf, len);
+        oneLen = oneLen + len;
+        r -> len = r -> len + len;
+        return;
+    }
+
+    runTab = GrowTab(runTab, &runMax, runCount + 1, sizeof *runTab);
+    r = &runTab[runCount++];
+    r -> cod = codPtr;
+    r -> ofs = oneLen;
+    r -> len = len;
+
+    if (len)
+    {
+        oneCode = GrowTab(oneCode, &oneMax, oneLen + len, 1);
+        memcpy(oneCode + oneLen, buf, len);
+        oneLen = oneLen + len;
+    }
+}
+
+
+/*
+ *  EvalFix - evaluate a DB, DW or DL value of size bytes
+ *
+ *  With -q, a value that uses labels not defined yet gets a fixup
+ *  instead of making the line unknown.  The line's bytes are kept by
+ *  OneCode at oneLen, so the value goes at oneLen + instrLen.  A
+ *  fixup returns 0, the pass 1 value could be out of range for a byte.
+ */
+
+int EvalFix(int size, bool big)
+{
+    char    *expr;
+    bool    known;
+    bool    err;
+    int     count;
+    int     val;
+    FixPtr  f;
+
+    expr  = linePtr;
+    known = lineKnown;
+    err   = errFlag;
+    count = errCount;
+    val   = Eval();
+
+    if (onePass && !evalKnown)
+    {
+        fixTab = GrowTab(fixTab, &fixMax, fixCount + 1, sizeof *fixTab);
+        f = &fixTab[fixCount++];
+        f -> ofs      = oneLen + instrLen;
+        f -> loc      = locPtr;
+        f -> cpu      = curCpuRec;
+        f -> scope[0] = GetScope('.');
+        f -> scope[1] = GetScope('@');
+        f -> expr     = ArenaAlloc(&asmArena, linePtr - expr + 1);
+        f -> size     = size;
+        f -> big      = big;
+        memcpy(f -> expr, expr, linePtr - expr);
+        f -> expr[linePtr - expr] = 0;
+
+        // a symbol that is never defined makes OneEnd fail instead
+        lineKnown = known;
+        errFlag   = err;
+        errCount  = count;
+        lineFixed = TRUE;
+
+        // OneEnd patches the bytes and checks the range of the real value
+        val = 0;
+    }
+
+    return val;
+}
+
+
+/*
+ *  OneEnd - finish -q after pass 1
+ *
+ *  Each fixup is evaluated again with the location, CPU and local
+ *  label scope of its line, and its bytes are patched.  Then the kept
+ *  code is written to the object file the same way pass 2 would have
+ *  written it.  Returns FALSE if the second pass is still needed.
+ */
+
+bool OneEnd(void)
+{
+    u_long  i;
+    int     n;
+    int     val;
+    FixPtr  f;
+    RunPtr  r;
+
+    if (!onePass)
+        return FALSE;
+    onePass = FALSE;
+
+    // errors after the last line, such as a missing ENDIF
+    if (errCount)
+    {
+        OneFail();
+        return FALSE;
+    }
+
+    for (i = 0; i < fixCount; i++)
+    {
+        f = &fixTab[i];
+
+        SelectCPU(f -> cpu);
+        locPtr      = f -> loc;
+        curScope[0] = f -> scope[0];
+        curScope[1] = f -> scope[1];
+        linePtr     = f -> expr;
+        errFlag     = FALSE;
+        evalSet     = FALSE;
+        val = Eval();
+
+        // a SET symbol may have had another value at the line
+        if (errFlag || !evalKnown || evalSet || (f -> size == 1 && (val < -128 || val > 255)))
+        {
+            OneFail();
+            return FALSE;
+        }
+
+        for (n = 0; n < f -> size; n++)
+            if (f -> big)
+                oneCode[f -> ofs + n] = val >> (8 * (f -> size - 1 - n));
+            else
+                oneCode[f -> ofs + n] = val >> (8 * n);
+    }
+
+    pass = 2;
+    CodeHeader(cl_SrcName);
+    for (i = 0; i < runCount; i++)
+    {
+        r = &runTab[i];
+        if (r -> len == 0)
+            CodeFlush();
+        else
+        {
+            CodeAbsOrg(r -> cod);
+            CodeBlock(oneCode + r -> ofs, r -> len);
+        }
+    }
+    CodeEnd();
+
+    oneDone = TRUE;
+    return TRUE;
+}
+
+
+// --------------------------------------------------------------
+// incremental assembly
+
+
+#define SUM_BASIS   0xCBF29CE484222325ULL   // FNV-1a starting value
+
+/*
+ *  SumBytes - add len bytes to a 64-bit FNV-1a hash
+ */
+
+unsigned long long SumBytes(unsigned long long h, const void *buf, size_t len)
+{
+    const u_char *p = buf;
+
+    while (len--)
+    {
+        h = h ^ *p++;
+        h = h * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+
+// writes a hash as 16 hex digits to sum[17]
+void SumText(char *sum, unsigned long long h)
+{
+    sprintf(sum, "%08lX%08lX", (u_long) (h >> 32), (u_long) (h & 0xFFFFFFFF));
+}
+
+
+// returns the content hash of a source file
+char *SrcSum(SrcPtr p)
+{
+    if (p -> sum[0] == 0)
+        SumText(p -> sum, SumBytes(SUM_BASIS, p -> text, p -> size));
+    return p -> sum;
+}
+
+
+// gets the content hash of a binary file, returns FALSE if it can't be read
+bool FileSum(char *fname, char *sum)
+{
+    FILE                *f;
+    size_t              n;
+    unsigned long long  h;
+
+    f = fopen(fname, "rb");
+    if (f == NULL)
+        return FALSE;
+
+    h = SUM_BASIS;
+    while ((n = fread(incBuf, 1, INCBIN_BUF, f)) > 0)
+        h = SumBytes(h, incBuf, n);
+    fclose(f);
+
+    SumText(sum, h);
+    return TRUE;
+}
+
+
+// gets the hash of a macro's parameter names and text
+void MacroSum(MacroPtr m, char *sum)
+{
+    MacroParmPtr        parm;
+    MacroLinePtr        ml;
+    unsigned long long  h;
+
+    h = SUM_BASIS;
+    for (parm = m -> parms; parm; parm = parm -> next)
+        h = SumBytes(h, parm -> name, strlen(parm -> name) + 1);
+    h = SumBytes(h, "", 1);
+    for (ml = m -> text; ml; ml = ml -> next)
+        h = SumBytes(h, ml -> text, strlen(ml -> text) + 1);
+
+    SumText(sum, h);
+}
+
+
+/*
+ *  IncBad - the include file being recorded can't be replayed
+ */
+
+void IncBad(void)
+{
+    if (incRec)
+        incRec -> bad = TRUE;
+}
+
+
+/*
+ *  IncState - note a line that a CPU module handled without making code
+ *
+ *  Such a line may have changed something only the CPU module knows
+ *  about, like a direct page register, so an include file can only
+ *  be reused after the same ones.
+ */
+
+void IncState(void)
+{
+    memoGen++;      // kept macro expansions may be different now
+    if (!incOn)
+        return;
+
+    incState = SumBytes(incState, line, strlen(line) + 1);
+    IncBad();
+}
+
+
+IncItemPtr IncAdd(IncPtr r, char type, char *name)
+{
+    IncItemPtr it;
+
+    r -> item = GrowTab(r -> item, &r -> maxitem, r -> nitem + 1, sizeof *r -> item);
+    it = &r -> item[r -> nitem++];
+    memset(it, 0, sizeof *it);
+    it -> type  = type;
+    it -> scope = -1;
+    it -> name  = ArenaStr(&strPool, name);
+
+    return it;
+}
+
+
+// adds len bytes at cod to the code of a record
+void IncAddCode(IncPtr r, u_long cod, u_char *buf, u_long len)
+{
+    IncItemPtr it;
+
+    it = r -> run ? &r -> item[r -> run - 1] : NULL;
+    if (it == NULL || it -> value + it -> len != cod)
+    {
+        it = IncAdd(r, 'C', "");
+        it -> value = cod;
+        it -> ofs   = r -> ncode;
+        r -> run    = r -> nitem;
+    }
+
+    r -> code = GrowTab(r -> code, &r -> maxcode, r -> ncode + len, 1);
+    memcpy(r -> code + r -> ncode, buf, len);
+    r -> ncode = r -> ncode + len;
+    it -> len  = it -> len + len;
+}
+
+
+void IncCode(u_char *buf, u_long len)
+{
+    IncAddCode(incRec, codPtr, buf, len);
+}
+
+
+void IncFile(char type, char *name, char *sum)
+{
+    IncAdd(incRec, type, name) -> sum = ArenaStr(&strPool, sum);
+}
+
+
+void IncMacro(MacroPtr m)
+{
+    char sum[17];
+
+    if (m -> incRef == incRec)
+        return;
+    m -> incRef = incRec;
+
+    MacroSum(m, sum);
+    IncFile('M', m -> name, sum);
+}
+
+
+// returns the offset of the '.' or '@' in a local label's name, else -1
+int IncScope(SymPtr p)
+{
+    if (p -> h.key == p -> name)
+        return -1;
+    return p -> h.key - p -> name - 1;
+}
+
+
+void IncRef(SymPtr p)
+{
+    IncItemPtr it;
+
+    if (p -> incRef == incRec)
+        return;
+    p -> incRef = incRec;
+
+    if (p -> isSet && !p -> known)
+        IncBad();   // it could still be SET to something else first
+
+    it = IncAdd(incRec, 'R', p -> name);
+    it -> flag  = !p -> known;
+    it -> scope = IncScope(p);
+    it -> value = p -> value;
+}
+
+
+void IncDef(SymPtr p, u_long val, bool setSym, bool equSym)
+{
+    IncItemPtr it;
+
+    if (setSym || p -> isSet)
+        IncBad();   // SET symbols change as the main file goes on
+    p -> incRef = incRec;   // later uses get the value from here
+
+    it = IncAdd(incRec, 'D', p -> name);
+    it -> flag  = equSym;
+    it -> scope = IncScope(p);
+    it -> value = val;
+}
+
+
+// finds a symbol by its full name, scope is from IncScope
+SymPtr IncSym(char *name, int scope, bool add)
+{
+    SymPtr      p;
+    ScopePtr    sc;
+    Str255      parent;
+    int         token;
+
+    if (scope < 0)
+    {
+        p = FindSym(name);
+        if (p == NULL && add)
+            p = AddSym(name);
+        return p;
+    }
+
+    token = name[scope];
+    memcpy(parent, name, scope);
+    parent[scope] = 0;
+    sc = FindScope(token != '.', parent, add);
+    if (sc == NULL)
+        return NULL;
+
+    p = (SymPtr) HashFind(&sc -> syms, name + scope + 1, HashStr(name + scope + 1));
+    if (p == NULL && add)
+        p = AddScopeSym(sc, token, name + scope + 1);
+    return p;
+}
+
+
+// checks that an include file would do the same things now as when recorded
+bool IncSame(IncPtr r)
+{
+    IncItemPtr  it;
+    SrcPtr      src;
+    MacroPtr    m;
+    SymPtr      p;
+    char        sum[17];
+    u_long      i;
+
+    SumText(sum, incState);
+    if (r -> loc[0] != locPtr || r -> cod[0] != codPtr || r -> cond != condLevel
+                              || r -> uid[0] != macUniqueID
+                              || strcmp(r -> cpu, curCpuRec ? curCpuRec -> name : "-")
+                              || strcmp(r -> state, sum)
+                              || strcmp(r -> last[0], lastLabl)
+                              || strcmp(r -> subr[0], subrLabl))
+        return FALSE;
+
+    for (i=0; i < r -> nitem; i++)
+    {
+        it = &r -> item[i];
+        switch(it -> type)
+        {
+            case 'F':
+                src = FindSrc(it -> name);
+                if (src == NULL || strcmp(SrcSum(src), it -> sum))
+                    return FALSE;
+                break;
+
+            case 'B':
+                if (!FileSum(it -> name, sum) || strcmp(sum, it -> sum))
+                    return FALSE;
+                break;
+
+            case 'M':
+                m = FindMacro(it -> name);
+                if (m == NULL)
+                    return FALSE;
+                MacroSum(m, sum);
+                if (strcmp(sum, it -> sum))
+                    return FALSE;
+                break;
+
+            case 'R':
+                // a forward reference must still be one, so that pass 1
+                // picks the same instruction forms, and IncCheck sees
+                // its value at the end of pass 1
+                p = IncSym(it -> name, it -> scope, FALSE);
+                if (p && p -> defined)
+                {
+                    if (it -> flag || p -> value != it -> value)
+                        return FALSE;
+                }
+                else if (!it -> flag)
+                    return FALSE;
+                break;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/*
+ *  IncReplay - do what a recorded include file did, without its source
+ */
+
+void IncReplay(IncPtr r)
+{
+    IncItemPtr  it;
+    u_long      i;
+
+    for (i=0; i < r -> nitem; i++)
+    {
+        it = &r -> item[i];
+        if (it -> type == 'D')
+            DefSymRec(IncSym(it -> name, it -> scope, TRUE), it -> value, FALSE, it -> flag);
+        else if (it -> type == 'C' && pass == 2)
+        {
+            codPtr = it -> value;
+            CodeBlock(r -> code + it -> ofs, it -> len);
+        }
+    }
+
+    locPtr = r -> loc[1];
+    codPtr = r -> cod[1];
+    macUniqueID = r -> uid[1];
+    SetLastLabl(r -> last[1]);
+    SetSubrLabl(r -> subr[1]);
+
+    if (pass == 2)
+    {
+        incNew = GrowTab(incNew, &incNewMax, incNewCount + 1, sizeof *incNew);
+        incNew[incNewCount++] = r;
+        incSkips++;
+    }
+}
+
+
+/*
+ *  IncSkip - see if an INCLUDE can reuse its record instead
+ *
+ *  Only INCLUDE lines of the main source file are recorded, nested
+ *  include files are part of the record of their parent.  Returns
+ *  TRUE if the record was replayed.
+ */
+
+bool IncSkip(char *name)
+{
+    IncPtr  r;
+    u_long  i;
+    int     occur;
+
+    incOccur = 0;
+    if (!incOn || nInclude >= 0 || macLineFlag)
+        return FALSE;
+
+    occur = 1;
+    for (i=0; i < incSeenCount; i++)
+        if (strcmp(incSeen[i], name) == 0)
+            occur++;
+    incSeen = GrowTab(incSeen, &incSeenMax, incSeenCount + 1, sizeof *incSeen);
+    incSeen[incSeenCount++] = ArenaStr(&strPool, name);
+    incOccur = occur;
+
+    r = NULL;
+    for (i=0; i < incOldCount && r == NULL; i++)
+        if (incOld[i] -> occur == occur && strcmp(incOld[i] -> name, name) == 0)
+            r = incOld[i];
+    if (r == NULL)
+        return FALSE;
+
+    if (pass == 1)
+    {
+        if (!incReuse || r -> failed || !IncSame(r))
+            return FALSE;
+        r -> skip = TRUE;
+    }
+    else if (!r -> skip)
+        return FALSE;
+
+    IncReplay(r);
+    return TRUE;
+}
+
+
+/*
+ *  IncStart - start recording an include file that was just opened
+ */
+
+void IncStart(char *name)
+{
+    IncPtr  r;
+    char    sum[17];
+
+    if (incRec)
+    {   // nested include file
+        IncFile('F', name, SrcSum(incSrc[nInclude]));
+        return;
+    }
+
+    if (pass != 2 || incOccur == 0)
+        return;
+
+    r = ArenaAlloc(&asmArena, sizeof *r);
+    memset(r, 0, sizeof *r);
+    SumText(sum, incState);
+    r -> name    = ArenaStr(&strPool, name);
+    r -> occur   = incOccur;
+    r -> cpu     = ArenaStr(&strPool, curCpuRec ? curCpuRec -> name : "-");
+    r -> state   = ArenaStr(&strPool, sum);
+    r -> cond    = condLevel;
+    r -> uid[0]  = macUniqueID;
+    r -> loc[0]  = locPtr;
+    r -> cod[0]  = codPtr;
+    r -> last[0] = ArenaStr(&strPool, lastLabl);
+    r -> subr[0] = ArenaStr(&strPool, subrLabl);
+
+    incRec = r;
+    IncFile('F', name, SrcSum(incSrc[nInclude]));
+}
+
+
+/*
+ *  IncEnd - finish the record at the end of an include file
+ */
+
+void IncEnd(void)
+{
+    IncPtr r;
+
+    r = incRec;
+    incRec = NULL;
+
+    if (condLevel != r -> cond)
+        r -> bad = TRUE;    // IF and ENDIF in different files
+
+    r -> uid[1]  = macUniqueID;
+    r -> loc[1]  = locPtr;
+    r -> cod[1]  = codPtr;
+    r -> last[1] = ArenaStr(&strPool, lastLabl);
+    r -> subr[1] = ArenaStr(&strPool, subrLabl);
+
+    incNew = GrowTab(incNew, &incNewMax, incNewCount + 1, sizeof *incNew);
+    incNew[incNewCount++] = r;
+}
+
+
+/*
+ *  IncCheck - check the forward references of reused include files
+ *
+ *  Called at the end of pass 1.  If a symbol used by a reused include
+ *  file was defined later with a different value, that file is marked
+ *  to be assembled, the symbols are forgotten and FALSE is returned to
+ *  do pass 1 again.
+ */
+
+bool IncCheck(void)
+{
+    IncPtr      r;
+    IncItemPtr  it;
+    SymPtr      p;
+    u_long      i,j;
+    bool        ok;
+
+    ok = TRUE;
+    for (i=0; i < incOldCount; i++)
+    {
+        r = incOld[i];
+        for (j=0; r -> skip && j < r -> nitem; j++)
+        {
+            it = &r -> item[j];
+            if (it -> type == 'R' && it -> flag)
+            {
+                p = IncSym(it -> name, it -> scope, FALSE);
+                if (p == NULL || !p -> defined || p -> value != it -> value)
+                {
+                    r -> failed = TRUE;
+                    ok = FALSE;
+                    break;
+                }
+            }
+        }
+    }
+    if (ok)
+        return TRUE;
+
+    for (i=0; i < incOldCount; i++)
+        incOld[i] -> skip = FALSE;
+    for (p = symTab; p; p = p -> next)
+        if (p -> defPass > 0)
+        {
+            p -> value    = 0;
+            p -> defined  = FALSE;
+            p -> multiDef = FALSE;
+            p -> isSet    = FALSE;
+            p -> equ      = FALSE;
+        }
+
+    return FALSE;
+}
+
+
+// gets the name of the state file
+void IncFileName(char *s)
+{
+    sprintf(s, "%.240s.state", (cl_Obj && !cl_Stdout) ? cl_ObjName : cl_SrcName);
+}
+
+
+// returns s, or "-" for an empty label
+char *IncLabl(char *s)
+{
+    return s[0] ? s : "-";
+}
+
+
+void IncFree(void);
+
+/*
+ *  IncLoad - read the records of the last assembly from the state file
+ */
+
+void IncLoad(void)
+{
+    FILE        *f;
+    Str255      fname;
+    char        s[1024];
+    Str255      cpu,state,last,subr;
+    IncPtr      r;
+    IncItemPtr  it;
+    u_char      buf[128];
+    u_long      val,cod;
+    int         scope,flag,n,len;
+    bool        ok;
+    char        *p;
+
+    IncFileName(fname);
+    f = fopen(fname, "r");
+    if (f == NULL)
+        return;     // no earlier assembly
+
+    r  = NULL;
+    ok = TRUE;
+    while (ok && fgets(s, sizeof s, f))
+    {
+        s[strcspn(s, "\r\n")] = 0;
+        if (s[0] == ';' || s[0] == 0)
+            continue;
+
+        n = 0;
+        if (strncmp(s, "INCLUDE ", 8) == 0)
+        {
+            r = ArenaAlloc(&asmArena, sizeof *r);
+            memset(r, 0, sizeof *r);
+            ok = sscanf(s + 8, "%d %n", &r -> occur, &n) == 1 && s[8 + n];
+            r -> name = ArenaStr(&strPool, s + 8 + n);
+            incOld = GrowTab(incOld, &incOldMax, incOldCount + 1, sizeof *incOld);
+            incOld[incOldCount++] = r;
+        }
+        else if (r == NULL)
+            ok = FALSE;
+        else if (strncmp(s, "ENTRY ", 6) == 0)
+        {
+            ok = sscanf(s + 6, "%lx %lx %d %d %255s %255s %255s %255s", &r -> loc[0], &r -> cod[0],
+                        &r -> cond, &r -> uid[0], cpu, state, last, subr) == 8;
+            r -> cpu     = ArenaStr(&strPool, cpu);
+            r -> state   = ArenaStr(&strPool, state);
+            r -> last[0] = ArenaStr(&strPool, strcmp(last, "-") ? last : "");
+            r -> subr[0] = ArenaStr(&strPool, strcmp(subr, "-") ? subr : "");
+        }
+        else if (strncmp(s, "EXIT ", 5) == 0)
+        {
+            ok = r -> cpu && sscanf(s + 5, "%lx %lx %d %255s %255s", &r -> loc[1], &r -> cod[1],
+                                    &r -> uid[1], last, subr) == 5;
+            r -> last[1] = ArenaStr(&strPool, strcmp(last, "-") ? last : "");
+            r -> subr[1] = ArenaStr(&strPool, strcmp(subr, "-") ? subr : "");
+            r = NULL;
+        }
+        else if (s[1] != ' ')
+            ok = FALSE;
+        else switch(s[0])
+        {
+            case 'F':
+            case 'B':
+            case 'M':
+                ok = sscanf(s + 2, "%16s %n", state, &n) == 1 && strlen(state) == 16 && s[2 + n];
+                if (ok)
+                    IncAdd(r, s[0], s + 2 + n) -> sum = ArenaStr(&strPool, state);
+                break;
+
+            case 'R':
+            case 'D':
+                ok = sscanf(s + 2, "%lx %d %d %n", &val, &scope, &flag, &n) == 3 && s[2 + n]
+                     && scope >= -1 && scope < 255 && scope < (int) strlen(s + 2 + n)
+                     && (scope < 0 || s[2 + n + scope] == '.' || s[2 + n + scope] == '@');
+                if (ok)
+                {
+                    it = IncAdd(r, s[0], s + 2 + n);
+                    it -> value = val;
+                    it -> scope = scope;
+                    it -> flag  = flag;
+                }
+                break;
+
+            case 'C':
+                ok = sscanf(s + 2, "%lx %n", &cod, &n) == 1;
+                len = 0;
+                for (p = s + 2 + n; ok && *p; p = p + 2)
+                {
+                    ok = len < (int) sizeof buf && ishex(p[0]) && ishex(p[1]);
+                    if (ok)
+                        buf[len++] = Hex2Dec(p[0]) * 16 + Hex2Dec(p[1]);
+                }
+                if (ok && len)
+                    IncAddCode(r, cod, buf, len);
+                break;
+
+            default:
+                ok = FALSE;
+                break;
+        }
+    }
+    fclose(f);
+
+    if (!ok || r)
+    {
+        fprintf(stderr, "Ignoring bad state file '%s'\n", fname);
+        IncFree();
+    }
+}
+
+
+/*
+ *  IncSave - write the records of this assembly to the state file
+ */
+
+void IncSave(void)
+{
+    FILE        *f;
+    Str255      fname;
+    IncPtr      r;
+    IncItemPtr  it;
+    u_long      i,j,k,n,m;
+    char        s[80];
+    char        *p;
+
+    if (incSkips == incNewCount && incNewCount == incOldCount)
+        return;     // all of it came from the state file
+
+    IncFileName(fname);
+    f = fopen(fname, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Unable to create state file '%s'\n", fname);
+        return;
+    }
+
+    fprintf(f, "; asmx include state for %s\n", cl_SrcName);
+    for (i=0; i < incNewCount; i++)
+    {
+        r = incNew[i];
+        if (r -> bad)
+            continue;
+
+        fprintf(f, "INCLUDE %d %s\n", r -> occur, r -> name);
+        fprintf(f, "ENTRY %lX %lX %d %d %s %s %s %s\n", r -> loc[0], r -> cod[0], r -> cond,
+                   r -> uid[0], r -> cpu, r -> state, IncLabl(r -> last[0]), IncLabl(r -> subr[0]));
+        for (j=0; j < r -> nitem; j++)
+        {
+            it = &r -> item[j];
+            switch(it -> type)
+            {
+                case 'F':
+                case 'B':
+                case 'M':
+                    fprintf(f, "%c %s %s\n", it -> type, it -> sum, it -> name);
+                    break;
+
+                case 'R':
+                case 'D':
+                    fprintf(f, "%c %lX %d %d %s\n", it -> type, it -> value, it -> scope,
+                               it -> flag, it -> name);
+                    break;
+
+                case 'C':
+                    for (k=0; k < it -> len; k = k + n)
+                    {
+                        n = it -> len - k;
+                        if (n > 32)
+                            n = 32;
+                        p = s;
+                        for (m=0; m < n; m++)
+                            p = ListByte(p, r -> code[it -> ofs + k + m]);
+                        *p = 0;
+                        fprintf(f, "C %lX %s\n", it -> value + k, s);
+                    }
+                    break;
+            }
+        }
+        fprintf(f, "EXIT %lX %lX %d %s %s\n", r -> loc[1], r -> cod[1], r -> uid[1],
+                   IncLabl(r -> last[1]), IncLabl(r -> subr[1]));
+    }
+
+    fclose(f);
+}
+
+
+/*
+ *  IncFree - release the include file records
+ */
+
+void IncFree(void)
+{
+    u_long i;
+
+    // a reused record is in both lists
+    for (i=0; i < incNewCount; i++)
+    {
+        free(incNew[i] -> item);
+        free(incNew[i] -> code);
+        incNew[i] -> item = NULL;
+        incNew[i] -> code = NULL;
+    }
+    for (i=0; i < incOldCount; i++)
+    {
+        free(incOld[i] -> item);
+        free(incOld[i] -> code);
+        incOld[i] -> item = NULL;
+        incOld[i] -> code = NULL;
+    }
+
+    free(incOld);
+    free(incNew);
+    free(incSeen);
+    incOld       = NULL;
+    incNew       = NULL;
+    incSeen      = NULL;
+    incOldCount  = 0;
+    incOldMax    = 0;
+    incNewCount  = 0;
+    incNewMax    = 0;
+    incSeenCount = 0;
+    incSeenMax   = 0;
+    incRec       = NULL;
+    incSkips     = 0;
+}
+
+
+// --------------------------------------------------------------
+// REPT, IRP and WHILE
+
+
+/*
+ *  LoopOpcode - find the opcode type of a line without doing anything
+ *               else, labl is set to its label
+ */
+
+int LoopOpcode(char *labl)
+{
+    Str255      opcode;
+    int         typ,parm;
+    int         token;
+    MacroPtr    xmacro;
+
+    // skip initial formfeeds
+    linePtr = line;
+    while (*linePtr == 12)
+        linePtr++;
+
+    // get label
+    labl[0] = 0;
+    if (isalphanum(*linePtr) || *linePtr == '.' || ((opts & OPT_ATSYM) && *linePtr == '@'))
+    {
+        token = GetWord(labl);
+        while (*linePtr == ' ' || *linePtr == '\t')
+            linePtr++;
+        if (token == '.')
+            GetWord(labl + 1);          // labl = "." + word
+
+        if (*linePtr == ':' && linePtr[1] != '=')
+            linePtr++;
+    }
+
+    typ = 0;
+    GetFindOpcode(opcode, &typ, &parm, &xmacro);
+    return typ;
+}
+
+
+/*
+ *  LoopCopy - start a new loop body with the first n lines of old
+ */
+
+MacroPtr LoopCopy(MacroPtr old, char *var, int n)
+{
+    MacroPtr        body;
+    MacroLinePtr    ml;
+
+    body = NewMacro("");
+    if (var)
+        AddMacroParm(body, var);
+    for (ml = old ? old -> text : NULL; n > 0; n--, ml = ml -> next)
+        AddMacroLine(body, ml -> text);
+
+    return body;
+}
+
+
+/*
+ *  LoopBody - read the lines of a loop up to its ENDR
+ *
+ *  The lines are listed as they are read.  If the loop line has
+ *  read the same lines before, the body from then is used again,
+ *  so that its compiled lines and line records are kept.  Returns
+ *  NULL if the lines have errors.
+ */
+
+MacroPtr LoopBody(char *var)
+{
+    LinePtr         *id;
+    LoopDefPtr      d;
+    MacroPtr        old;    // the body from last time, if it can be used again
+    MacroPtr        body;
+    MacroLinePtr    same;   // next line of the old body if the lines match so far
+    Str255          labl;
+    u_long          k;
+    int             n;
+    int             i,typ;
+    int             condLevel,loopLevel;
+    int             errs;
+
+    // find what this line read the last time
+    id = lineId;
+    d = NULL;
+    for (k = loopDefCount; id && k > 0 && d == NULL; k--)
+        if (loopDefs[k-1].id == id)
+            d = &loopDefs[k-1];
+    old = NULL;
+    if (d && (var == NULL) == (d -> body -> parms == NULL)
+          && (var == NULL || strcmp(var, d -> body -> parms -> name) == 0))
+        old = d -> body;
+    body = NULL;
+    same = old ? old -> text : NULL;
+    n = 0;
+
+    errs      = errCount;
+    condLevel = 0;
+    loopLevel = 0;
+    typ       = 0;
+    i = ReadSourceLine();
+    while (i && typ != o_REPEND)
+    {
+        // lines of a macro are only listed with the macro
+        if ((pass == 2 || cl_ListP1) && (listFlag || errFlag) && (errFlag || listMacFlag || !macLineFlag))
+            ListOut(TRUE);
+        CopyListLine();
+
+        typ = LoopOpcode(labl);
+        switch(typ)
+        {
+            case o_IF:
+                condLevel++;
+                break;
+
+            case o_ENDIF:
+                if (condLevel)
+                    condLevel--;
+                else
+                    Error("ENDIF without IF in loop");
+                break;
+
+            case o_END:
+                Error("END not allowed inside a loop");
+                break;
+
+            case o_REPEAT:
+                loopLevel++;
+                break;
+
+            case o_REPEND:
+                if (loopLevel)
+                {
+                    loopLevel--;
+                    typ = 0;
+                }
+                break;
+        }
+
+        if (typ != o_END && (typ != o_REPEND || labl[0]))
+        {
+            if (same && strcmp(same -> text, typ == o_REPEND ? labl : line) == 0)
+            {
+                same = same -> next;
+                n++;
+            }
+            else
+            {
+                if (body == NULL)
+                {   // the lines differ from here on, so make a new body
+                    body = LoopCopy(old, var, n);
+                    same = NULL;
+                }
+                AddMacroLine(body, typ == o_REPEND ? labl : line);
+            }
+        }
+
+        if (typ != o_REPEND)
+            i = ReadSourceLine();
+    }
+
+    if (condLevel)
+        Error("IF block without ENDIF in loop");
+
+    if (typ != o_REPEND)
+        Error("Missing ENDR");
+
+    if (errCount != errs)
+        return NULL;
+
+    // the same lines as last time
+    if (body == NULL && old && same == NULL)
+    {
+        loopReused++;
+        return old;
+    }
+
+    // fewer lines than last time, or the first time
+    if (body == NULL)
+        body = LoopCopy(old, var, n);
+    MacCompile(body);
+
+    if (id)
+    {
+        if (d == NULL)
+        {
+            loopDefs = GrowTab(loopDefs, &loopDefMax, loopDefCount + 1, sizeof *loopDefs);
+            d = &loopDefs[loopDefCount++];
+            d -> id = id;
+        }
+        d -> body = body;
+    }
+
+    return body;
+}
+
+
+/*
+ *  LoopTest - see if a WHILE loop goes around again
+ */
+
+bool LoopTest(LoopPtr l)
+{
+    char    *oldLine;
+    int     val;
+
+    if (l -> n >= MAX_LOOP)
+    {
+        Error("Too many loop iterations");
+        return FALSE;
+    }
+
+    oldLine = linePtr;
+    linePtr = l -> expr;
+    val = Eval();
+    linePtr = oldLine;
+
+    if (!evalKnown)
+    {
+        Error("Undefined label used in WHILE");
+        return FALSE;
+    }
+
+    return val != 0;
+}
+
+
+/*
+ *  DoLoop - REPT, IRP and WHILE
+ *
+ *      REPT count[,var]        var is SET to 0 to count-1
+ *      IRP var,item[,item...]  var is replaced by each item like a macro parameter
+ *      WHILE expr              while expr is not zero
+ *
+ *  The body up to ENDR is read once, then it runs as a macro level
+ *  of its own.
+ */
+
+void DoLoop(int kind)
+{
+    Str255      var;
+    LoopPtr     l;
+    MacroPtr    body;
+    int         level;
+    int         token;
+    int         quote;
+    long        count;
+    char        *p,*end;
+    char        c;
+
+    // a loop takes the next macro level, its parameters go there
+    level = macPtr[macLevel] ? macLevel + 1 : macLevel;
+    if (level >= MAX_MACRO)
+    {
+        Error("Macros nested too deeply");
+        LoopBody(NULL);
+        return;
+    }
+    l = &loopTab[level];
+    p = macParmsLine[level];
+
+    var[0] = 0;
+    count = 0;
+    l -> items = NULL;
+    switch(kind)
+    {
+        default:
+        case LOOP_REPT:
+            count = Eval();
+            if (!evalKnown)
+                Error("Undefined label used in REPT count");
+            else if (count < 0)
+                IllegalOperand();
+            token = GetWord(var);
+            if (token == ',')
+            {
+                if (GetWord(var) != -1)
+                    IllegalOperand();
+            }
+            else if (token)
+                IllegalOperand();
+            break;
+
+        case LOOP_IRP:
+            if (GetWord(var) != -1)
+            {
+                IllegalOperand();
+                break;
+            }
+            if (Comma())
+                break;
+
+            // split the rest of the line at commas outside of quotes
+            strncpy(p, linePtr, MAX_LINE - 1);
+            p[MAX_LINE - 1] = 0;
+            linePtr = linePtr + strlen(linePtr);
+            l -> items = ArenaAlloc(&asmArena, (strlen(p) + 1) * sizeof *l -> items);
+            while (*p && *p != ';')
+            {
+                // skip whitespace before the item
+                while (isblank_ff(*p))
+                    p++;
+                l -> items[count++] = p;
+
+                // skip to the end of the item
+                quote = 0;
+                while ((c = *p) && (quote || (c != ',' && c != ';')))
+                {
+                    if (c == '"' || c == 0x27)
+                    {
+                        if (quote == 0)
+                            quote = c;
+                        else if (quote == c)
+                            quote = 0;
+                    }
+                    p++;
+                }
+
+                // remove whitespace from the end of the item
+                end = p;
+                while (end > l -> items[count-1] && (end[-1] == ' ' || end[-1] == 9))
+                    end--;
+                c = *p;
+                *end = 0;
+                if (c == ',')
+                    p++;
+                else
+                    *p = 0;
+            }
+            break;
+
+        case LOOP_WHILE:
+            // keep the expression for the next times around
+            strncpy(p, linePtr, MAX_LINE - 1);
+            p[MAX_LINE - 1] = 0;
+            l -> expr = p;
+            count = Eval() != 0;
+            if (!evalKnown)
+                Error("Undefined label used in WHILE");
+            break;
+    }
+
+    body = LoopBody(kind == LOOP_IRP && var[0] ? var : NULL);
+    if (body == NULL || errFlag || count <= 0)
+        return;
+
+    // an empty body has nothing to go around, a WHILE would never end
+    if (body -> text == NULL)
+    {
+        if (kind == LOOP_WHILE)
+            Error("WHILE loop has no body");
+        return;
+    }
 
-    if (pass == 2 && showStdErr && ((errFlag && cl_Err) || (warnFlag && cl_Warn)))
-        fprintf(stderr,"%s\n",listLine);
+    // start the first time around
+    l -> kind  = kind;
+    l -> body  = body;
+    l -> n     = 0;
+    l -> count = count;
+    l -> var   = NULL;
+    loopCount++;
+
+    macLevel = level;
+    macPtr [macLevel] = body;
+    macLine[macLevel] = body -> text;
+    memoNext[macLevel] = NULL;
+    macCurrentID[macLevel] = macUniqueID++;
+    numMacParms[macLevel] = 0;
+    for (token = 0; token < MAXMACPARMS; token++)
+        macParms[token + macLevel * MAXMACPARMS] = "";
+
+    if (kind == LOOP_REPT && var[0])
+    {
+        l -> var = ArenaStr(&strPool, var);
+        DefSym(l -> var, 0, TRUE, FALSE);
+    }
+    if (kind == LOOP_IRP)
+    {
+        numMacParms[macLevel] = 1;
+        macParms[macLevel * MAXMACPARMS] = l -> items[0];
+    }
 }
 
 
-void CopyListLine(void)
+/*
+ *  LoopNext - at the end of a loop body, start it again if it isn't done
+ *
+ *  Returns FALSE when the loop is done.
+ */
+
+bool LoopNext(void)
 {
-    int n;
-    char c,*p,*q;
+    LoopPtr l;
+    bool    more;
 
-    p = listLine;
-    q = line;
-    listLineFF = FALSE;
+    l = &loopTab[macLevel];
+    l -> n++;
+    switch(l -> kind)
+    {
+        default:
+        case LOOP_REPT:
+            more = l -> n < l -> count;
+            if (more && l -> var)
+                DefSym(l -> var, l -> n, TRUE, FALSE);
+            break;
 
-    // the old version
-//  strcpy(listLine, "                ");       // 16 blanks
-//  strncat(listLine, line, 255-16);
+        case LOOP_IRP:
+            more = l -> n < l -> count;
+            if (more)
+                macParms[macLevel * MAXMACPARMS] = l -> items[l -> n];
+            break;
 
-    if (listWid == LIST_24)
-        for (n=24; n; n--) *p++ = ' ';  // 24 blanks at start of line
-    else
-        for (n=16; n; n--) *p++ = ' ';  // 16 blanks at start of line
+        case LOOP_WHILE:
+            more = LoopTest(l);
+            break;
+    }
 
-    while (n < 255-16 && (c = *q++))    // copy rest of line, stripping out form feeds
+    if (!more)
     {
-        if (c == 12) listLineFF = TRUE; // if a form feed was found, remember it for later
-        else
-        {
-            *p++ = c;
-            n++;
-        }
+        l -> kind = LOOP_NONE;
+        return FALSE;
     }
-    *p = 0;   // string terminator
+
+    loopIters++;
+    macLine[macLevel] = l -> body -> text;
+    macCurrentID[macLevel] = macUniqueID++;
+    return TRUE;
 }
 
 
@@ -3605,7 +8008,8 @@ void DoOpcode(int typ, int parm)
                 else
                 {
                     linePtr = oldLine;
-                    val = EvalByte();
+                    val = EvalFix(1, FALSE);
+                    CheckByte(val);
                     if (instrLen < MAX_BYTSTR)
                         bytStr[instrLen++] = val;
                 }
@@ -3713,7 +8117,7 @@ void DoOpcode(int typ, int parm)
 #endif
                 {
                     linePtr = oldLine;
-                    val = Eval();
+                    val = EvalFix(2, (endian == BIG_END) ^ (typ == o_DWRE));
                     if ((endian == LITTLE_END) ^ (typ == o_DWRE))
                     {   // little endian
                         if (instrLen < MAX_BYTSTR)
@@ -3812,7 +8216,7 @@ void DoOpcode(int typ, int parm)
 #endif
                 {
                     linePtr = oldLine;
-                    val = Eval();
+                    val = EvalFix(4, (endian == BIG_END) ^ (typ == o_DWRE));
                     if ((endian == LITTLE_END) ^ (typ == o_DWRE))
                     {   // little endian
                         if (instrLen < MAX_BYTSTR)
@@ -4126,6 +8530,8 @@ void DoOpcode(int typ, int parm)
 
         case o_Include:
             GetFName(word);
+            if (IncSkip(word))
+                break;      // same as the last time with -u
 
             switch(OpenInclude(word))
             {
@@ -4137,6 +8543,7 @@ void DoOpcode(int typ, int parm)
                     Error(s);
                     break;
                 default:
+                    IncStart(word);
                     break;
             }
             break;
@@ -4145,11 +8552,9 @@ void DoOpcode(int typ, int parm)
             Error("ENDM without MACRO");
             break;
 
-#ifdef ENABLE_REP
         case o_REPEND:
-            Error("REPEND without REPEAT");
+            Error("ENDR without REPT");
             break;
-#endif
 
         case o_Processor:
             if (!GetWord(word)) MissingOperand();
@@ -4175,9 +8580,13 @@ void DoLabelOp(int typ, int parm, char *labl)
     int         nparms;
     SegPtr      seg;
     char        *oldLine;
-//  struct MacroRec repList;        // repeat text list
-//  MacroLinePtr    rep,rep2;       // pointer into repeat text list
+    MacDefPtr   def;
+    LinePtr     *id;
+    int         errs,nlines;
+    bool        bodyLast,bodyAddr,newLast;
     char        *p;
+    struct stat st;
+    bool        bad;
 
     if (DoCPULabelOp(typ,parm,labl)) return;
 
@@ -4188,7 +8597,20 @@ void DoLabelOp(int typ, int parm, char *labl)
                 Error("Missing label");
             else
             {
-                val = Eval();
+                oldLine = linePtr;
+                if (EquCheck(labl))
+                {   // the loop is the error, not its undefined symbols
+                    val = 0;
+                    linePtr = linePtr + strlen(linePtr);
+                }
+                else if (pass == 1 && parm == 0)
+                {   // an EQU can wait for the symbols it uses to be defined
+                    val = EquEval();
+                    if (EquDefer(labl, oldLine))
+                        break;
+                }
+                else
+                    val = Eval();
 
                 // "XXXX  (XXXX)"
                 p = listLine;
@@ -4254,7 +8676,7 @@ void DoLabelOp(int typ, int parm, char *labl)
 
         case o_SUBR:
             token = GetWord(word);  // get subroutine name
-            strcpy(subrLabl,word);
+            SetSubrLabl(word);
             break;
 
         case o_REND:
@@ -4366,6 +8788,8 @@ void DoLabelOp(int typ, int parm, char *labl)
                 break;
             }
 
+            IncBad();   // a replayed include file can't define it
+
             macro = FindMacro(labl);
             if (macro && macro -> def)
                 Error("Macro multiply defined");
@@ -4395,6 +8819,8 @@ void DoLabelOp(int typ, int parm, char *labl)
                     if (word[0] && !errFlag)
                         Error("Illegal operand");
                 }
+                else if (onePass)
+                    OneFail();  // multiply defined, which only shows in pass 2
 
                 if (pass == 2)
                 {
@@ -4404,12 +8830,36 @@ void DoLabelOp(int typ, int parm, char *labl)
                 }
 
                 macroCondLevel = 0;
-                i = ReadSourceLine(line, sizeof(line));
+                id       = lineId;
+                errs     = errCount;
+                nlines   = 0;
+                bodyLast = FALSE;
+                bodyAddr = FALSE;
+                i = ReadSourceLine();
+
+                // pass 2 only needs to list the lines up to the ENDM line
+                if ((def = MacDefFind(macro, id)))
+                {
+                    for (n = def -> nlines; n > 0 && i; n--)
+                    {
+                        if (listFlag || errFlag)
+                            ListOut(TRUE);
+                        CopyListLine();
+                        i = ReadSourceLine();
+                    }
+                    macDefSkips += def -> nlines;
+                    if (def -> last)
+                        SetLastLabl(def -> last);
+                    if (def -> addr)
+                        showAddr = TRUE;
+                }
+
                 while (i && typ != o_ENDM)
                 {
                     if ((pass == 2 || cl_ListP1) && (listFlag || errFlag))
                         ListOut(TRUE);
                     CopyListLine();
+                    newLast = FALSE;
 
                     // skip initial formfeeds
                     linePtr = line;
@@ -4437,16 +8887,12 @@ void DoLabelOp(int typ, int parm, char *labl)
 #else
                             if (token == '.')
 #endif
+                                GetWord(labl + 1);          // labl = "." + word
+                            else
                             {
-                                GetWord(word);
-                                if (token == '.' && subrLabl[0])    strcpy(labl,subrLabl);
-                                                            else    strcpy(labl,lastLabl);
-                                labl[strlen(labl)+1] = 0;
-                                labl[strlen(labl)]   = token;
-                                strcat(labl,word);          // labl = lastLabl + "." + word;
+                                SetLastLabl(labl);
+                                newLast = TRUE;
                             }
-                            else
-                                strcpy(lastLabl,labl);
                         }
 
                         if (*linePtr == ':' && linePtr[1] != '=')
@@ -4459,13 +8905,13 @@ void DoLabelOp(int typ, int parm, char *labl)
                     switch(typ)
                     {
                         case o_IF:
-                            if (pass == 1)
+                            if (passNum == 1)
                                 AddMacroLine(macro,line);
                             macroCondLevel++;
                             break;
 
                         case o_ENDIF:
-                            if (pass == 1)
+                            if (passNum == 1)
                                 AddMacroLine(macro,line);
                             if (macroCondLevel)
                                 macroCondLevel--;
@@ -4478,19 +8924,34 @@ void DoLabelOp(int typ, int parm, char *labl)
                             break;
 
                         case o_ENDM:
-                            if (pass == 1 && labl[0])
+                            if (passNum == 1 && labl[0])
                                 AddMacroLine(macro,labl);
                             break;
 
                         default:
-                            if (pass == 1)
+                            if (passNum == 1)
                                 AddMacroLine(macro,line);
                             break;
                     }
                     if (typ != o_ENDM)
-                        i = ReadSourceLine(line, sizeof(line));
+                    {
+                        nlines++;
+                        if (newLast)
+                        {
+                            strcpy(s, labl);
+                            bodyLast = TRUE;
+                        }
+                        bodyAddr = showAddr;
+                        i = ReadSourceLine();
+                    }
                 }
 
+                if (passNum == 1 && typ == o_ENDM)
+                    MacCompile(macro);
+                if (pass == 1)
+                    MacDefAdd(macro, id, nlines, bodyLast ? s : NULL, bodyAddr,
+                              typ == o_ENDM && macroCondLevel == 0 && errCount == errs);
+
                 if (macroCondLevel)
                     Error("IF block without ENDIF in macro definition");
 
@@ -4564,188 +9025,117 @@ void DoLabelOp(int typ, int parm, char *labl)
                 condLevel--;
             break;
 
-#ifdef ENABLE_REP
-// still under construction
-// notes:
-//      REPEAT pseudo-op should act like an inline macro
-//      1) collect all lines into new macro level
-//      2) copy parameters from previous macro level (if any)
-//      3) set repeat count for this macro level (repeat count is set to 0 for plain macro)
-//      4) when macro ends, decrement repeat count and start over if count > 0
-//      5) don't forget to dispose of the temp macro and its lines when done!
         case o_REPEAT:
             if (labl[0])
             {
                 DefSym(labl,locPtr,FALSE,FALSE);
                 showAddr = TRUE;
             }
+            DoLoop(parm);
+            break;
 
-            // get repeat count
-            val = Eval();
-            if (!errFlag)
-                if (val < 0) IllegalOperand();
+       case o_Incbin:
+            DefSym(labl,locPtr,FALSE,FALSE);
 
-            if (!errFlag)
+            // an unquoted name ends at a comma when an offset follows
+            while (*linePtr == ' ' || *linePtr == '\t')
+                linePtr++;
+            oldLine = linePtr;
+            GetFName(word);
+            if (*oldLine != '"' && *oldLine != 0x27 && (p = strchr(word, ',')))
             {
-                repList -> text = NULL;
+                *p = 0;
+                linePtr = strchr(oldLine, ',');
+            }
 
-// *** read line
-// *** while line not REPEND
-// ***      add line to repeat buffer
-                macroCondLevel = 0;
-                i = ReadSourceLine(line, sizeof(line));
-                while (i && typ != o_REPEND)
+            // optional offset and length in the file
+            n = 0;      // offset
+            val = -1;   // length
+            oldLine = linePtr;
+            token = GetWord(s);
+            if (token == ',')
+            {
+                n = Eval();
+                if (!evalKnown)
                 {
-                    if ((pass == 2 || cl_ListP1) && (listFlag || errFlag))
-                        ListOut(TRUE);
-                    CopyListLine();
-
-                    // skip initial formfeeds
-                    linePtr = line;
-                    while (*linePtr == 12)
-                        linePtr++;
-
-                    // get label
-                    labl[0] = 0;
-#ifdef TEMP_LBLAT
-                    if (isalphanum(*linePtr) || *linePtr == '.')
-#else
-                    if (isalphanum(*linePtr) || *linePtr == '.' || ((opts & OPT_ATSYM) && *linePtr == '@'))
-#endif
-                    {
-                        token = GetWord(labl);
-                        if (token)
-                            showAddr = TRUE;
-                            while (*linePtr == ' ' || *linePtr == '\t')
-                                linePtr++;
-
-                        if (labl[0])
-                        {
-#ifdef TEMP_LBLAT
-                            if (token == '.' || token == '@'))
-#else
-                            if (token == '.')
-#endif
-                            {
-                                GetWord(word);
-                                if (token == '.' && subrLabl[0])    strcpy(labl,subrLabl);
-                                                            else    strcpy(labl,lastLabl);
-                                labl[strlen(labl)+1] = 0;
-                                labl[strlen(labl)]   = token;
-                                strcat(labl,word);          // labl = lastLabl + "." + word;
-                            }
-                            else
-                                strcpy(lastLabl,labl);
-                        }
-
-                        if (*linePtr == ':' && linePtr[1] != '=')
-                            linePtr++;
-                    }
-
-                    typ = 0;
-                    GetFindOpcode(opcode, &typ, &parm, &xmacro);
+                    Error("Can't use INCBIN with forward-declared offset");
+                    break;
+                }
 
-                    switch(typ)
+                oldLine = linePtr;
+                token = GetWord(s);
+                if (token == ',')
+                {
+                    val = Eval();
+                    if (!evalKnown)
                     {
-                        case o_IF:
-                            if (pass == 1)
-                                AddMacroLine(&replist,line);
-                            macroCondLevel++;
-                            break;
-
-                        case o_ENDIF:
-                            if (pass == 1)
-                                AddMacroLine(&replist,line);
-                            if (macroCondLevel)
-                                macroCondLevel--;
-                            else
-                                Error("ENDIF without IF in REPEAT block");
-                            break;
-
-                        case o_END:
-                            Error("END not allowed inside REPEAT block");
-                            break;
-
-                        case o_ENDM:
-                            if (pass == 1 && labl[0])
-                                AddMacroLine(&replist,labl);
-                            break;
-
-                        default:
-                            if (pass == 1)
-                                AddMacroLine(&replist,line);
-                            break;
+                        Error("Can't use INCBIN with forward-declared length");
+                        break;
                     }
-                    if (typ != o_ENDM)
-                        i = ReadSourceLine(line, sizeof(line));
                 }
+                else
+                    linePtr = oldLine;
+            }
+            else
+                linePtr = oldLine;
 
-                if (macroCondLevel)
-                    Error("IF block without ENDIF in REPEAT block");
-
-                if (typ != o_REPEND)
-                    Error("Missing REPEND");
-
-                if (!errFlag)
+            // only the size is needed in pass 1, unless it keeps the code
+            bad = stat(word, &st) != 0 || S_ISDIR(st.st_mode);
+            if (!bad)
+            {
+                if (n < 0 || n > st.st_size)
+                {
+                    Error("INCBIN offset is outside of the file");
+                    n = st.st_size;
+                }
+                if (val < 0 || val > st.st_size - n)
                 {
-// *** while (val--)
-// ***      for each line
-// ***            doline()
+                    if (val > 0)
+                        Error("INCBIN length is past the end of the file");
+                    val = st.st_size - n;
                 }
 
-                // free repeat line buffer
-                while (replist)
+                if (pass == 2 || onePass)
                 {
-                    rep = replist->next;
-                    free(replist);
-                    replist = rep;
+                    incbin = fopen(word, "rb");
+                    bad = incbin == NULL || fseek(incbin, n, SEEK_SET) != 0;
                 }
             }
-            break;
-#endif
-
-       case o_Incbin:
-            DefSym(labl,locPtr,FALSE,FALSE);
-
-            GetFName(word);
-
-            val = 0;
 
-            // open binary file
-            incbin = fopen(word, "r");
-
-            if (incbin)
+            if (bad)
             {
-                // while not EOF
-                do {
-                    //   n = count of read up to MAX_BYTSTR bytes into bytStr
-                    n = fread(bytStr, 1, MAX_BYTSTR, incbin);
-                    if (n>0)
-                    {
-                        // write data out to the object file
-                        for (i=0; i<n; i++)
-                            CodeOut(bytStr[i]);
-                        val = val + n;
-                    }
-                } while (n>0);
-                if (n<0)
-                    sprintf(s,"Error reading INCBIN file '%s'",word);
+                sprintf(s,"Unable to open INCBIN file '%.200s'",word);
+                Error(s);
+            }
+            else if (pass == 1 && !onePass)
+                AddLocPtr(val);
+            else
+            {
+                if (incRec && FileSum(word, s))
+                    IncFile('B', word, s);
 
-                if (pass == 2)
+                // write data out to the object file
+                for (i = val; i > 0; i = i - n)
                 {
-                    // "XXXX  (XXXX)"
-                    p = ListLoc(locPtr-val);
-                    *p++ = ' ';
-                    *p++ = '(';
-                    p = ListAddr(p,val);
-                    *p++ = ')';
+                    n = fread(incBuf, 1, i < INCBIN_BUF ? i : INCBIN_BUF, incbin);
+                    if (n <= 0)
+                    {
+                        sprintf(s,"Error reading INCBIN file '%.200s'",word);
+                        Error(s);
+                        break;
+                    }
+                    CodeBlock(incBuf, n);
                 }
+                // keep the location the same as in pass 1
+                if (i > 0)
+                    AddLocPtr(i);
 
-            }
-            else
-            {
-                sprintf(s,"Unable to open INCBIN file '%s'",word);
-                Error(s);
+                // "XXXX  (XXXX)"
+                p = ListLoc(locPtr-val);
+                *p++ = ' ';
+                *p++ = '(';
+                p = ListAddr(p,val);
+                *p++ = ')';
             }
 
             // close binary file
@@ -4755,6 +9145,7 @@ void DoLabelOp(int typ, int parm, char *labl)
             break;
 
         case o_WORDSIZE:
+            IncState();
             if (labl[0])
                 Error("Label not allowed");
 
@@ -4780,35 +9171,27 @@ void DoLabelOp(int typ, int parm, char *labl)
 }
 
 
-void DoLine()
-{
-    Str255      labl;
-    Str255      opcode;
-    int         typ;
-    int         parm;
-    int         i;
-    Str255      word;
-    int         token;
-    MacroPtr    macro;
-    char        *oldLine;
-    char        *p;
-    int         numhex;
-    bool        firstLine;
+/*
+ *  GetLabel - get the label at the start of line[]
+ *
+ *  linePtr is left at the opcode.  Returns TRUE if local labels
+ *  after it belong to it.
+ */
 
-    errFlag      = FALSE;
-    warnFlag     = FALSE;
-    instrLen     = 0;
-    showAddr     = FALSE;
-    listThisLine = listFlag;
-    firstLine    = TRUE;
-    CopyListLine();
+bool GetLabel(char *labl)
+{
+    char    *oldLine;
+    int     token;
+    int     typ;
+    int     parm;
+    bool    last;
 
     // skip initial formfeeds
     linePtr = line;
     while (*linePtr == 12)
         linePtr++;
 
-    // look for label at beginning of line
+    last = FALSE;
     labl[0] = 0;
 #ifdef TEMP_LBLAT
     if (isalphaul(*linePtr) || *linePtr == '$' || *linePtr == '.' || *linePtr == '@')
@@ -4823,7 +9206,7 @@ void DoLine()
         while (*linePtr == ' ' || *linePtr == '\t')
             linePtr++;
 
-           if (labl[0])
+        if (labl[0])
         {
 #ifdef TEMP_LBLAT
             if (token == '.' || token == '@')
@@ -4831,28 +9214,65 @@ void DoLine()
             if (token == '.')
 #endif
             {
-                GetWord(word);
-                if (token == '.' && FindOpcodeTab((OpcdPtr) &opcdTab2, word, &typ, &parm) )
+                GetWord(labl + 1);          // labl = "." + word
+                if (token == '.' && FindOpcodeIdx(opcdIdx2, labl + 1, HashStr(labl + 1), &typ, &parm) )
+                {
                     linePtr = oldLine;
-                else if (token == '.' && FindCPU(word))
-                    linePtr = line;
-                else
+                    labl[1] = 0;
+                }
+                else if (token == '.' && FindCPU(labl + 1))
                 {
-                if (token == '.' && subrLabl[0])    strcpy(labl,subrLabl);
-                                            else    strcpy(labl,lastLabl);
-                labl[strlen(labl)+1] = 0;
-                labl[strlen(labl)]   = token;
-                strcat(labl,word);          // labl = lastLabl + "." + word;
+                    linePtr = line;
+                    labl[1] = 0;
                 }
             }
             else
-                strcpy(lastLabl,labl);
+                last = TRUE;
         }
 
         if (*linePtr == ':' && linePtr[1] != '=')
             linePtr++;
     }
 
+    return last;
+}
+
+
+void DoLine()
+{
+    Str255      labl;
+    Str255      opcode;
+    int         typ;
+    int         parm;
+    int         i;
+    Str255      word;
+    MacroPtr    macro;
+    char        *p;
+    int         numhex;
+    bool        firstLine;
+    IrPtr       ir;
+    int         defs;
+    u_long      refs;
+
+    errFlag      = FALSE;
+    warnFlag     = FALSE;
+    lineKnown    = TRUE;
+    lineFixed    = FALSE;
+    instrLen     = 0;
+    showAddr     = FALSE;
+    listThisLine = listFlag;
+    firstLine    = TRUE;
+    CopyListLine();
+    curLine = FindLine();
+    ir = IrLine();
+    passLines++;
+    defs = symDefCount;
+    refs = symRefs;
+
+    // look for label at beginning of line
+    if (GetLabel(labl))
+        SetLastLabl(labl);
+
     if (!(condState[condLevel] & condTRUE))
     {
         listThisLine = FALSE;
@@ -4931,9 +9351,32 @@ void DoLine()
     }
     else
     {
-        if (!GetFindOpcode(opcode, &typ, &parm, &macro) && !opcode[0])
+        if (pass == 2 && ir && ir -> code && !incRec && !memoRec)
+        {   // same code as in pass 1
+            showAddr = TRUE;
+            DefSym(labl,locPtr,FALSE,FALSE);
+
+            instrLen  = ir -> len;
+            hexSpaces = ir -> hexSpaces;
+            memcpy(bytStr, ir -> code, abs(instrLen));
+            irHits++;
+        }
+        else if (memoCur)
+        {   // same line as the kept expansion
+            showAddr  = memoCur -> addr;
+            instrLen  = memoCur -> len;
+            hexSpaces = memoCur -> hexSpaces;
+            memcpy(bytStr, memoCur -> code, abs(instrLen));
+
+            if (pass == 1)
+                IrSave(ir, defs);
+        }
+        else if (!GetFindOpcode(opcode, &typ, &parm, &macro) && !opcode[0])
         {   // line with label only
             DefSym(labl,locPtr / wordDiv,FALSE,FALSE);
+
+            if (memoRec && macLineFlag && macLevel == memoLevel)
+                MemoAdd(!labl[0], defs, refs);
         }
         else
         {
@@ -4949,6 +9392,8 @@ void DoLine()
             }
             else if (typ == o_MacName)
             {
+                MemoStop();     // an expansion that invokes a macro isn't kept
+
                 if (macPtr[macLevel] && macLevel >= MAX_MACRO)
                     Error("Macros nested too deeply");
 #if 1
@@ -4962,11 +9407,12 @@ void DoLine()
 
                     macPtr [macLevel] = macro;
                     macLine[macLevel] = macro -> text;
-#ifdef ENABLE_REP
-                    macRepeat[macLevel] = 0;
-#endif
+                    loopTab[macLevel].kind = LOOP_NONE;
 
                     GetMacParms(macro);
+                    if (incRec)
+                        IncMacro(macro);
+                    MemoStart(macro);
 
                     showAddr = TRUE;
                     DefSym(labl,locPtr,FALSE,FALSE);
@@ -4976,21 +9422,41 @@ void DoLine()
             {
                 showAddr = FALSE;
                 DoLabelOp(typ,parm,labl);
+
+                // an EQU keeps its pass 1 value, and a different IF
+                // makes pass 2 read different lines, but anything
+                // else could change what later lines do
+                if (!lineKnown && pass == 1 && !(typ == o_EQU && parm == 0)
+                               && typ != o_IF && typ != o_ELSIF)
+                    irStop = TRUE;
             }
             else
             {
                 showAddr = TRUE;
                 DefSym(labl,locPtr,FALSE,FALSE);
+                defs = symDefCount;
                 DoOpcode(typ, parm);
             }
 
             if (typ != o_Illegal && typ != o_MacName)
                 if (!errFlag && GetWord(word))
                     Error("Too many operands");
+
+            if (pass == 1 && typ < o_LabelOp && typ != o_Illegal && typ != o_MacName)
+                IrSave(ir, defs);
+
+            // only instruction and data lines can be kept
+            if (memoRec && macLineFlag && macLevel == memoLevel && typ != o_MacName)
+                MemoAdd(!labl[0] && (typ < o_Illegal || (typ >= o_DB && typ <= o_ASCIIZ && typ != o_DS)),
+                        defs, refs);
         }
 
         if (pass == 1 && !cl_ListP1)
+        {
+            if (onePass && instrLen)
+                OneCode(bytStr, abs(instrLen));
             AddLocPtr(abs(instrLen));
+        }
         else
         {
             p = listLine;
@@ -5030,6 +9496,9 @@ void DoLine()
                 }
             }
 
+            if (incRec && instrLen)
+                IncCode(bytStr, abs(instrLen));
+
             if (instrLen>0) // positive instrLen for CPU instruction formatting
             {
                 // determine start of hex data area
@@ -5116,6 +9585,10 @@ void DoLine()
                 ListOut(firstLine);
         }
     }
+
+    // anything but known values and fixups needs the second pass
+    if (onePass && (errFlag || warnFlag || !lineKnown))
+        OneFail();
 }
 
 
@@ -5128,15 +9601,17 @@ void DoPass()
     MacroPtr    macro;
     SegPtr      seg;
 
-    fseek(source, 0, SEEK_SET); // rewind source file
     sourceEnd = FALSE;
-    lastLabl[0] = 0;
-    subrLabl[0] = 0;
+    SetLastLabl("");
+    SetSubrLabl("");
 
-    fprintf(stderr,"Pass %d\n",pass);
+    fprintf(stderr,"Pass %d\n",passNum);
 
     if (cl_ListP1)
-        fprintf(listing,"Pass %d\n",pass);
+        fprintf(listing,"Pass %d\n",passNum);
+
+    symChanged    = 0;
+    passUnknown   = FALSE;
 
     errCount      = 0;
     condLevel     = 0;
@@ -5148,11 +9623,15 @@ void DoPass()
     tempSymFlag   = TRUE;
     linenum       = 0;
     macLevel      = 0;
+    for (i = 0; i < MAX_MACRO; i++)
+        loopTab[i].kind = LOOP_NONE;
     macUniqueID   = 0;
     macCurrentID[0] = 0;
     curAsm        = NULL;
+    curCpuRec     = NULL;
     endian        = UNKNOWN_END;
     opcdTab       = NULL;
+    opcdIdx       = NULL;
     listWid       = LIST_24;
     addrWid       = ADDR_32;
     wordSize      = 8;
@@ -5174,17 +9653,44 @@ void DoPass()
 
     if (pass == 2) CodeHeader(cl_SrcName);
 
+    if (pass == 1)
+    {
+        irCount     = 0;
+        macDefCount = 0;
+    }
+    irNext     = 0;
+    irStop     = FALSE;
+    macDefNext = 0;
+
+    // kept expansions start over, this pass may not change state in the same places
+    HashFree(&memoHash);
+    memoRec  = NULL;
+    memoCur  = NULL;
+    memoNext[0] = NULL;
+
+    incRec       = NULL;
+    incSeenCount = 0;
+    incState     = SUM_BASIS;
+
+    if (pass == 1)
+        EquClear();
+    passLines = 0;
+
     PassInit();
-    i = ReadSourceLine(line, sizeof(line));
+    i = ReadSourceLine();
     while (i && !sourceEnd)
     {
         DoLine();
-        i = ReadSourceLine(line, sizeof(line));
+        condSkip = !(condState[condLevel] & condTRUE);
+        i = ReadSourceLine();
     }
 
     if (condLevel != 0)
         Error("IF block without ENDIF");
 
+    if (pass == 1)
+        EquLoops();
+
     if (pass == 2) CodeEnd();
 
     // Put the lines after the END statement into the listing file
@@ -5211,7 +9717,7 @@ void DoPass()
             if (listThisLine)
                 ListOut(TRUE);
 
-            i = ReadSourceLine(line, sizeof(line));
+            i = ReadSourceLine();
         }
     }
 
@@ -5221,6 +9727,193 @@ void DoPass()
 // initialization and parameters
 
 
+/*
+ *  ShowStats - show statistics for -v option
+ */
+
+void ShowStats(void)
+{
+    fprintf(stderr, "Memory usage:\n");
+    ArenaReport(&asmArena,  "objects");
+    ArenaReport(&strPool,   "strings");
+    ArenaReport(&permArena, "cpu tables");
+    ArenaReport(&lineArena, "lines");
+    fprintf(stderr, "%-12s %10u entries, %10u buckets\n", "symbols", symHash.count, symHash.size);
+    fprintf(stderr, "%-12s %10u entries, %10u buckets\n", "scopes", scopeHash[0].count + scopeHash[1].count,
+                                                           scopeHash[0].size  + scopeHash[1].size);
+    fprintf(stderr, "%-12s %10u files,   %10u hits\n", "source", srcMisses, srcHits);
+    fprintf(stderr, "%-12s %10u lines,   %10u reused\n", "last pass", irCount, irHits);
+    fprintf(stderr, "%-12s %10u compiled,%10u reused\n", "expressions", exprCount, exprHits);
+    fprintf(stderr, "%-12s %10u waited,  %10u resolved\n", "equates", equDeferred, equResolved);
+    fprintf(stderr, "%-12s %10u entries, %10d skipped\n", "macros", macroHash.count, macDefSkips);
+    fprintf(stderr, "%-12s %10d run,     %10d repeated, %d reused\n", "loops", loopCount, loopIters, loopReused);
+    fprintf(stderr, "%-12s %10d kept,    %10d reused\n", "expansions", memoKept, memoHits);
+    fprintf(stderr, "%-12s %10d jumps,   %10lu lines\n", "failed IF", condJumps, condSkipped);
+    if (cl_OnePass)
+        fprintf(stderr, "%-12s %10lu fixups,  %10s\n", "single pass", fixCount, oneDone ? "done" : "not used");
+    if (cl_Incr)
+        fprintf(stderr, "%-12s %10lu files,   %10d reused\n", "includes", incNewCount, incSkips);
+}
+
+
+/*
+ *  JobFree - release the memory used by one assembly
+ *
+ *  The CPU tables and the source files stay for the next job of a
+ *  server.
+ */
+
+void JobFree(void)
+{
+    HashPtr     p;
+    u_int       i,j;
+
+    // local label tables own their bucket arrays
+    for (i=0; i<2; i++)
+    {
+        for (j=0; j < scopeHash[i].size; j++)
+            for (p = scopeHash[i].bucket[j]; p; p = p -> hnext)
+                HashFree(&((ScopePtr) p) -> syms);
+        HashFree(&scopeHash[i]);
+        curScope[i] = NULL;
+    }
+    HashFree(&symHash);
+    HashFree(&macroHash);
+    free(macDefs);
+    macDefs     = NULL;
+    macDefCount = 0;
+    macDefMax   = 0;
+    macDefSkips = 0;
+    free(loopDefs);
+    loopDefs     = NULL;
+    loopDefCount = 0;
+    loopDefMax   = 0;
+    loopCount    = 0;
+    loopIters    = 0;
+    loopReused   = 0;
+    HashFree(&memoHash);
+    memoKept     = 0;
+    memoHits     = 0;
+    condJumps    = 0;
+    condSkipped  = 0;
+    HashFree(&srcNames);
+    srcHits   = 0;
+    srcMisses = 0;
+    free(irTab);
+    irTab   = NULL;
+    irCount = 0;
+    irMax   = 0;
+    irHits  = 0;
+    exprCount = 0;
+    exprHits  = 0;
+    OneFail();
+    oneDone = FALSE;
+    IncFree();
+    EquClear();
+    free(equQueue);
+    equQueue    = NULL;
+    equQueueMax = 0;
+    curLine  = NULL;
+    lineSlot = NULL;
+    srcMain  = NULL;
+    ArenaFree(&asmArena);
+    ArenaFree(&strPool);
+
+    symTab   = NULL;
+    macroTab = NULL;
+    segTab   = NULL;
+}
+
+
+/*
+ *  SrcRelease - release the text and tables of a source file
+ */
+
+void SrcRelease(SrcPtr p)
+{
+    if (p -> text == spanText)
+    {
+        spanText = NULL;
+        spanEnd  = NULL;
+    }
+    srcBytes = srcBytes - SrcSize(p);
+    free(p -> text);
+    free(p -> lineOfs);
+    free(p -> condNext);
+    free(p -> labelLine);
+    free(p -> lines);
+}
+
+
+/*
+ *  SrcDropOld - release the files that were replaced by a newer version
+ *
+ *  The records themselves stay in lineArena until SrcFree.
+ */
+
+void SrcDropOld(void)
+{
+    SrcPtr  p;
+
+    for (p = srcOld; p; p = (SrcPtr) p -> h.hnext)
+        SrcRelease(p);
+    srcOld = NULL;
+}
+
+
+/*
+ *  SrcFree - release the source files and their line records
+ */
+
+void SrcFree(void)
+{
+    HashPtr     p;
+    u_int       i;
+
+    SrcDropOld();
+    for (i=0; i < srcHash.size; i++)
+        for (p = srcHash.bucket[i]; p; p = p -> hnext)
+            SrcRelease((SrcPtr) p);
+    HashFree(&srcHash);
+    ArenaFree(&lineArena);
+}
+
+
+/*
+ *  AsmFree - release all memory used by the assembler
+ */
+
+void AsmFree(void)
+{
+    OpcdIdxPtr  x;
+    RegTabPtr   t;
+    u_int       i;
+
+    JobFree();
+    SrcFree();
+    HashFree(&cpuHash);
+    for (x = opcdIdxTab; x; x = x -> next)
+    {
+        HashFree(&x -> names);
+        HashFree(&x -> wild);
+    }
+    opcdIdxTab = NULL;
+    opcdIdx    = NULL;
+    opcdIdx2   = NULL;
+    for (i=0; i<REGTAB_SIZE; i++)
+    {
+        for (t = regTabs[i]; t; t = t -> next)
+            HashFree(&t -> names);
+        regTabs[i] = NULL;
+    }
+    ArenaFree(&permArena);
+
+    asmTab   = NULL;
+    cpuTab   = NULL;
+    curCpuRec = NULL;
+}
+
+
 void stdversion(void)
 {
     fprintf(stderr,"%s version %s\n",VERSION_NAME,VERSION);
@@ -5234,6 +9927,7 @@ void usage(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "    %s [options] srcfile\n",progname);
+    fprintf(stderr, "    %s -S socket        run as a server for clients with ASMX_SERVER=socket\n",progname);
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    --                  end of options\n");
@@ -5256,7 +9950,14 @@ void usage(void)
     if (defCPU[0]) fprintf(stderr, "%s",defCPU);
               else fprintf(stderr, "no default");
     fprintf(stderr,")\n");
-    exit(1);
+    fprintf(stderr, "    -i filename         import symbols from a file made with -x\n");
+    fprintf(stderr, "    -x filename         export symbols to a file after assembly\n");
+    fprintf(stderr, "    -v                  show statistics at end of assembly\n");
+    fprintf(stderr, "    -f                  start a new object record when the CPU type changes\n");
+    fprintf(stderr, "    -p passes           use up to this many passes to pick the shortest forms (default 2)\n");
+    fprintf(stderr, "    -q                  assemble in one pass when forward references are only in data\n");
+    fprintf(stderr, "    -u                  reuse include files that have not changed since the last -u\n");
+    AsmExit(1);
 }
 
 
@@ -5269,7 +9970,7 @@ void getopts(int argc, char * const argv[])
     int     token;
     int     neg;
 
-    while ((ch = getopt(argc, argv, "ew19tb:cmd:l:o:s:C:?")) != -1)
+    while ((ch = getopt(argc, argv, "ew19tb:cmd:l:o:s:C:vi:x:fp:qu?")) != -1)
     {
         errFlag = FALSE;
         switch (ch)
@@ -5431,11 +10132,44 @@ void getopts(int argc, char * const argv[])
 					  printf("%-12s (%s)\n", p->name,p->as->name);
 					  p = p -> next;
 					}
-                    exit(1);
+                    AsmExit(1);
                 }
                 strcpy(defCPU, word);
                 break;
 
+            case 'v':
+                cl_Verbose = TRUE;
+                break;
+
+            case 'i':
+                strncpy(cl_ImportName, optarg, 255);
+                break;
+
+            case 'x':
+                strncpy(cl_ExportName, optarg, 255);
+                break;
+
+            case 'f':
+                cl_CpuFlush = TRUE;
+                break;
+
+            case 'p':
+                cl_Passes = atoi(optarg);
+                if (cl_Passes < 2)
+                {
+                    fprintf(stderr,"%s: The -p option needs a number of passes of at least 2\n",progname);
+                    usage();
+                }
+                break;
+
+            case 'q':
+                cl_OnePass = TRUE;
+                break;
+
+            case 'u':
+                cl_Incr = TRUE;
+                break;
+
             case '?':
             default:
                 usage();
@@ -5509,14 +10243,19 @@ void getopts(int argc, char * const argv[])
 }
 
 
-int main(int argc, char * const argv[])
-{
-    int i;
+/*
+ *  AsmJob - assemble one source file as given by a command line
+ */
 
+int AsmJob(int argc, char * const argv[])
+{
     // initialize and get parms
 
     progname   = argv[0];
+    line       = lineBuf;
+    jobNum++;
     pass       = 0;
+    passNum    = 0;
     symTab     = NULL;
     xferAddr   = 0;
     xferFound  = FALSE;
@@ -5534,31 +10273,33 @@ int main(int argc, char * const argv[])
     cl_Obj     = FALSE;
     cl_ObjType = OBJ_HEX;
     cl_ListP1  = FALSE;
+    cl_Verbose = FALSE;
+    cl_CpuFlush = FALSE;
+    cl_Passes  = 2;
+    cl_OnePass = FALSE;
+    cl_Incr    = FALSE;
+    cl_Stdout  = FALSE;
+    cl_ImportName[0] = 0;
+    cl_ExportName[0] = 0;
 
-    asmTab     = NULL;
-    cpuTab     = NULL;
-    defCPU[0]  = 0;
+    DefaultCPU();
 
     nInclude  = -1;
-    for (i=0; i<MAX_INCLUDE; i++)
-        include[i] = NULL;
 
-    cl_SrcName [0] = 0;     source  = NULL;
+    cl_SrcName [0] = 0;
     cl_ListName[0] = 0;     listing = NULL;
     cl_ObjName [0] = 0;     object  = NULL;
     incbin = NULL;
 
-    AsmInit();
-
     getopts(argc, argv);
 
     // open files
 
-    source = fopen(cl_SrcName, "r");
-    if (source == NULL)
+    srcMain = FindSrc(cl_SrcName);
+    if (srcMain == NULL)
     {
         fprintf(stderr,"Unable to open source input file '%s'!\n",cl_SrcName);
-        exit(1);
+        AsmExit(1);
     }
 
     if (cl_List)
@@ -5567,9 +10308,7 @@ int main(int argc, char * const argv[])
         if (listing == NULL)
         {
             fprintf(stderr,"Unable to create listing output file '%s'!\n",cl_ListName);
-            if (source)
-                fclose(source);
-            exit(1);
+            AsmExit(1);
         }
     }
 
@@ -5583,38 +10322,463 @@ int main(int argc, char * const argv[])
         if (object == NULL)
         {
             fprintf(stderr,"Unable to create object output file '%s'!\n",cl_ObjName);
-            if (source)
-                fclose(source);
             if (listing)
                 fclose(listing);
-            exit(1);
+            AsmExit(1);
         }
     }
 
+    if (cl_ImportName[0])
+        ImportSyms(cl_ImportName);
+
     CodeInit();
 
     pass = 1;
+    passNum = 1;
+    onePass  = cl_OnePass && !cl_Incr && !cl_List && !cl_ListP1;
+    incOn    = cl_Incr && cl_Passes <= 2;
+    incReuse = incOn && !cl_List && !cl_ListP1;
+    if (incReuse)
+        IncLoad();
     DoPass();
 
-    pass = 2;
-    DoPass();
+    // with -u, a reused include file may have used a symbol that
+    // turned out different, so assemble it and do pass 1 again
+    while (!IncCheck())
+    {
+        passNum++;
+        DoPass();
+    }
+
+    // with -q, the code of pass 1 is done if all of its fixups resolve
+    if (!OneEnd())
+    {
+        // with more than two passes, size again from the addresses of the
+        // previous pass until they stop changing
+        if (cl_Passes > 2 && passUnknown)
+        {
+            do
+            {
+                passNum++;
+                DoPass();
+            } while (symChanged && passNum < cl_Passes - 1);
+
+            // the last pass may still move things, so don't reuse any code
+            if (symChanged)
+                irCount = 0;
+        }
+
+        pass = 2;
+        passNum++;
+        DoPass();
+    }
+
+    if (incOn && errCount == 0)
+        IncSave();
 
     if (cl_List)    fprintf(listing, "\n%.5d Total Error(s)\n\n", errCount);
     if (cl_Err)     fprintf(stderr,  "\n%.5d Total Error(s)\n\n", errCount);
 
-    if (symtabFlag)
-    {
+    if (symtabFlag || cl_ExportName[0])
         SortSymTab();
+    if (symtabFlag)
         DumpSymTab();
-    }
+    if (cl_ExportName[0])
+        ExportSyms(cl_ExportName);
 //  DumpMacroTab();
 
-    if (source)
-        fclose(source);
     if (listing)
         fclose(listing);
     if (object && object != stdout)
         fclose(object);
 
+    if (cl_Verbose)
+        ShowStats();
+
     return (errCount != 0);
 }
+
+
+// --------------------------------------------------------------
+// server mode
+
+#ifndef _WIN32
+
+#define SERVE_CACHE (64L << 20) // bytes of source files and lines a server keeps between jobs
+#define SERVE_MAXJOB 65536      // maximum size of a job's directory and arguments
+
+
+/*
+ *  SockRead - read exactly len bytes from a socket
+ */
+
+bool SockRead(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len)
+    {
+        n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        buf = (char *) buf + n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+
+/*
+ *  SockWrite - write exactly len bytes to a socket
+ */
+
+bool SockWrite(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len)
+    {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        buf = (const char *) buf + n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+
+/*
+ *  SockOpen - make a socket address for a server's path name
+ *
+ *  Returns -1 if the name is too long or there is no socket.
+ */
+
+int SockOpen(char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof addr -> sun_path)
+    {
+        fprintf(stderr,"%s: Socket name '%s' is too long\n",progname,path);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof *addr);
+    addr -> sun_family = AF_UNIX;
+    strcpy(addr -> sun_path, path);
+
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+
+/*
+ *  ServeJob - run one job for a client
+ *
+ *  A job is its stdin, stdout and stderr, then the length of the text
+ *  that follows, then the text: the client's current directory and its
+ *  arguments, each ending with a zero byte.  The exit status goes back
+ *  when the job is done.
+ */
+
+void ServeJob(int conn, const char *home, int *save)
+{
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr  *cm;
+    union
+    {
+        struct cmsghdr h;
+        char    buf[CMSG_SPACE(3 * sizeof(int))];
+    }               ctl;
+    jmp_buf         env;
+    const char      *name;
+    int             fds[3];
+    int             len,argc,status,i;
+    char            *text,*p,*end;
+    char            **argv;
+
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base = &len;
+    iov.iov_len  = sizeof len;
+    msg.msg_iov  = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof len)
+        return;
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL || cm -> cmsg_level != SOL_SOCKET || cm -> cmsg_type != SCM_RIGHTS)
+        return;
+    if (cm -> cmsg_len != CMSG_LEN(sizeof fds))
+    {   // close whatever came with it
+        for (i = 0; CMSG_LEN((i + 1) * sizeof(int)) <= cm -> cmsg_len; i++)
+            close(((int *) CMSG_DATA(cm))[i]);
+        return;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof fds);
+
+    // get the directory and arguments
+    text = NULL;
+    argv = NULL;
+    argc = 0;
+    if (len > 1 && len <= SERVE_MAXJOB && (text = malloc(len)) != NULL
+                && SockRead(conn, text, len) && text[len - 1] == 0)
+    {
+        end = text + len;
+        for (p = text + strlen(text) + 1; p < end; p += strlen(p) + 1)
+            argc++;
+        argv = malloc((argc + 1) * sizeof *argv);
+    }
+    if (argv == NULL || argc == 0)
+    {
+        for (i = 0; i < 3; i++)
+            close(fds[i]);
+        free(text);
+        free(argv);
+        return;
+    }
+    argc = 0;
+    for (p = text + strlen(text) + 1; p < end; p += strlen(p) + 1)
+        argv[argc++] = p;
+    argv[argc] = NULL;
+
+    // run the job with the client's files and directory
+    for (i = 0; i < 3; i++)
+    {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    name   = progname;
+    status = 1;
+    if (chdir(text) != 0)
+        fprintf(stderr,"%s: Unable to change to directory '%s'\n",argv[0],text);
+    else
+    {
+#ifdef __GLIBC__
+        optind = 0;         // start getopt over
+#else
+        optind = 1;
+        optreset = 1;
+#endif
+        jobExit = &env;
+        if (setjmp(env) == 0)
+            status = AsmJob(argc, argv);
+        else
+        {   // the files of a fatal error are left open
+            if (listing)
+                fclose(listing);
+            if (object && object != stdout)
+                fclose(object);
+            if (incbin)
+                fclose(incbin);
+            listing = NULL;
+            object  = NULL;
+            incbin  = NULL;
+        }
+        jobExit = NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    JobFree();
+    SrcDropOld();
+    if (lineArena.total + srcBytes > SERVE_CACHE)
+        SrcFree();
+    if (chdir(home) != 0)
+        AsmExit(1);         // nowhere to go back to
+    for (i = 0; i < 3; i++)
+        dup2(save[i], i);
+    clearerr(stdout);
+    clearerr(stderr);
+    progname = name;
+
+    SockWrite(conn, &status, sizeof status);
+    free(text);
+    free(argv);
+}
+
+
+/*
+ *  AsmServe - run jobs for clients until killed
+ *
+ *  The CPU tables and opcode indexes are set up once, and source files
+ *  are only read again when they change.  Jobs run one at a time.
+ */
+
+int AsmServe(char *path)
+{
+    struct sockaddr_un  addr;
+    struct stat         st;
+    char                home[4096];
+    int                 save[3];
+    int                 sock,conn,i;
+    mode_t              mask;
+
+    sock = SockOpen(path, &addr);
+    if (sock < 0)
+        return 1;
+
+    // a socket left over from an old server is in the way
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    // only the same user can send jobs
+    mask = umask(077);
+    i = bind(sock, (struct sockaddr *) &addr, sizeof addr);
+    umask(mask);
+    if (i != 0 || listen(sock, 16) != 0 || getcwd(home, sizeof home) == NULL)
+    {
+        fprintf(stderr,"%s: Unable to start server on '%s': %s\n",progname,path,strerror(errno));
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < 3; i++)
+        save[i] = dup(i);
+
+    AsmInit();
+
+    for (;;)
+    {
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr,"%s: Server stopped: %s\n",progname,strerror(errno));
+            break;
+        }
+        ServeJob(conn, home, save);
+        close(conn);
+    }
+
+    close(sock);
+    AsmFree();
+    return 1;
+}
+
+
+/*
+ *  AsmClient - send the command line to a server
+ *
+ *  Returns the exit status of the job, or -1 if there is no server
+ *  to do it.  Once the job has been sent, it may already have run,
+ *  so losing the server after that is a failure and not a -1.
+ */
+
+int AsmClient(char *path, int argc, char * const argv[])
+{
+    struct sockaddr_un  addr;
+    struct msghdr       msg;
+    struct iovec        iov;
+    struct cmsghdr      *cm;
+    union
+    {
+        struct cmsghdr h;
+        char    buf[CMSG_SPACE(3 * sizeof(int))];
+    }                   ctl;
+    int                 fds[3] = { 0, 1, 2 };
+    char                *text,*p;
+    int                 sock,len,status,i;
+    void                (*oldPipe)(int);
+
+    sock = SockOpen(path, &addr);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof addr) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    // the current directory and the arguments
+    text = malloc(SERVE_MAXJOB);
+    if (text == NULL || getcwd(text, SERVE_MAXJOB) == NULL)
+        len = SERVE_MAXJOB;
+    else
+        len = strlen(text) + 1;
+    for (i = 0; i < argc && len < SERVE_MAXJOB; i++)
+    {
+        p = argv[i];
+        if (strlen(p) >= (size_t) (SERVE_MAXJOB - len))
+            len = SERVE_MAXJOB;
+        else
+        {
+            strcpy(text + len, p);
+            len += strlen(p) + 1;
+        }
+    }
+    if (len >= SERVE_MAXJOB)
+    {
+        free(text);
+        close(sock);
+        return -1;
+    }
+
+    // stdin, stdout and stderr go with the length
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base = &len;
+    iov.iov_len  = sizeof len;
+    msg.msg_iov  = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    cm = CMSG_FIRSTHDR(&msg);
+    cm -> cmsg_level = SOL_SOCKET;
+    cm -> cmsg_type  = SCM_RIGHTS;
+    cm -> cmsg_len   = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cm), fds, sizeof fds);
+
+    // a server that has gone away must not kill the client
+    oldPipe = signal(SIGPIPE, SIG_IGN);
+    status = -1;
+    if (sendmsg(sock, &msg, 0) == sizeof len && SockWrite(sock, text, len))
+    {
+        if (SockRead(sock, &i, sizeof i))
+            status = i;
+        else
+        {
+            fprintf(stderr,"%s: Lost the server on '%s' during the job\n",progname,path);
+            status = 1;
+        }
+    }
+    signal(SIGPIPE, oldPipe);
+
+    free(text);
+    close(sock);
+    return status;
+}
+
+#endif
+
+
+int main(int argc, char * const argv[])
+{
+    int status;
+
+    progname = argv[0];
+
+#ifndef _WIN32
+    char *server;
+
+    // -S runs a server, and ASMX_SERVER sends the job to one
+    if (argc == 3 && strcmp(argv[1], "-S") == 0)
+        return AsmServe(argv[2]);
+    server = getenv("ASMX_SERVER");
+    if (server && server[0] && (status = AsmClient(server, argc, argv)) >= 0)
+        return status;
+#endif
+
+    asmTab = NULL;
+    cpuTab = NULL;
+    AsmInit();
+    status = AsmJob(argc, argv);
+    AsmFree();
+
+    return status;
+}
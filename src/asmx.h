@@ -147,16 +147,18 @@ char * ListByte(char *p, u_char b);
 // various internal variables used by the assemblers
 extern  bool            errFlag;            // TRUE if error occurred this line
 extern  int             pass;               // Current assembler pass
+extern  int             passNum;            // number of the current pass, counting all of them
 extern  char           *linePtr;            // pointer into current line
 extern  int             instrLen;           // Current instruction length (negative to display as long DB)
-extern  Str255          line;               // Current line from input file
+extern  char           *line;               // Current line from input file
 extern  char           *linePtr;            // pointer into current line
 extern  u_long          locPtr;             // Current program address
 extern  int             instrLen;           // Current instruction length (negative to display as long DB)
 extern  u_char          bytStr[MAX_BYTSTR]; // Current instruction / buffer for long DB statements
 extern  bool            showAddr;           // TRUE to show LocPtr on listing
 extern  int             endian;             // 0 = little endian, 1 = big endian, -1 = undefined endian
-extern  bool            evalKnown;          // TRUE if all operands in Eval were "known"
+extern  bool            evalKnown;          // TRUE if all operands in Eval were "known", or estimated by an earlier -p pass
+extern  bool            lineKnown;          // TRUE if the line's code can be reused in pass 2
 extern  int             curCPU;             // current CPU index for current assembler
 extern  Str255          listLine;           // Current listing line
 extern  int             hexSpaces;          // flags for spaces in hex output for instructions
@@ -0,0 +1,62 @@
+; the lines of a failed IF block are passed over to the next line
+; that could be IF, ELSE, ELSIF or ENDIF
+
+	CPU	Z80
+	LIST	MACRO
+
+	ORG	100H
+
+TOP	NOP
+	IF	0
+SKIP	NOP			; a label in a failed block
+.loc	NOP
+	IF	1		; nested blocks stay failed
+	NOP
+	ELSE
+	NOP
+	ENDIF
+	if	1		; lower case
+	nop
+	endif
+	.IF	1		; dotted
+	NOP
+	.ENDIF
+IFX	EQU	3		; names that start like IF, ELSE or ENDIF
+ELSEWHERE NOP
+ENDIFY	NOP
+	ELSIF	0
+	NOP
+	ELSIF	1		; the first true ELSIF
+.x	NOP			; ENDIFY.X, the last label passed over
+	ELSE
+	NOP
+	ENDIF
+
+	IF	0
+	REPT	3		; loops in a failed block
+	NOP
+	ENDR
+	INCLUDE	nofile.inc	; not read
+	ELSE
+	DB	1
+	ENDIF
+
+M	MACRO	x
+	IF	x
+	DB	x
+	ELSE
+	DB	0FFH
+	ENDIF
+	ENDM
+
+	M	0
+	M	2
+	IF	0
+	M	3
+	ENDIF
+
+; errors
+
+	ELSE			; outside of IF
+	IF	0
+	NOP			; no ENDIF
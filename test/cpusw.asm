@@ -0,0 +1,17 @@
+; switching CPUs keeps the object record going, unless -f is given
+
+	CPU	Z80
+	ORG	100H
+	LD	A,1
+	DB	1,2
+
+	CPU	6502
+	LDA	#1
+	DB	3,4
+
+	CPU	Z80
+	LD	A,2
+
+	CPU	6809		; big endian, the word order changes
+	DW	1234H
+	LDA	#5
@@ -0,0 +1,6 @@
+; -d FOO=5 conflicts with the EQU below
+
+	CPU	Z80
+
+FOO	EQU	6
+	DB	FOO
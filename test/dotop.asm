@@ -0,0 +1,17 @@
+; ".OP" is looked up as OP in the pseudo-ops, and then as a macro
+
+	CPU	Z80
+	LIST	MACRO
+
+	ORG	100H
+
+TWO	MACRO	a
+	DB	a,a
+	ENDM
+
+	.DB	1		; pseudo-op
+	.TWO	2		; macro
+	TWO	3
+	.ORG	110H
+	.DW	$
+	.NOTHING		; neither
@@ -0,0 +1,30 @@
+; EQU chains that refer to labels defined later are resolved in
+; pass 1, and a loop of EQUs is reported with its labels
+
+	CPU	Z80
+
+A1	EQU	A2+1		; a chain of forward EQUs
+A2	EQU	A3*2
+A3	EQU	A4-1
+A4	EQU	TWO+1
+
+	ORG	100H
+
+BASE	LD	A,A1
+	LD	HL,A2
+	JR	NEXT
+TWO	EQU	2		; resolves the chain
+	DS	A3		; known from here on
+NEXT	LD	BC,A4
+	LD	DE,SIZE
+
+SIZE	EQU	ENDP-BASE	; forward label
+ENDP
+
+; errors
+
+C1	EQU	C2+1		; C1 -> C2 -> C3 -> C1
+C2	EQU	C3+1
+C3	EQU	C1+1
+SELF	EQU	SELF		; an EQU of itself
+	DW	C1,SELF
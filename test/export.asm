@@ -0,0 +1,14 @@
+; symbols for import.asm, written with -x
+
+	CPU	Z80
+
+	ORG	1000H
+
+START	LD	HL,TABLE
+.loop	DJNZ	.loop
+	RET
+
+TABLE	DB	1,2,3
+TABLEN	EQU	$-TABLE
+COUNT	SET	5		; SET symbols are not exported
+PORT	EQU	0FEH
@@ -0,0 +1,40 @@
+; expressions, each line's compiled expression is used again in
+; pass 2 and for each macro expansion
+
+	CPU	6502
+
+	ORG	$1000
+
+; operators and precedence
+	DW	1+2*3, (1+2)*3, [1+2]*3, 7/2, 7%3, -7/2
+	DW	1<<4, $8000>>3, $F0F0&$0FF0, $F000|$000F, $FF00^$0FF0
+	DW	~0, !0, !5, -(-3), +4
+	DB	<$1234, >$1234, L($1234), H($1234)
+	DW	1=1, 1==2, 1<2, 2<=2, 3>4, 3>=3
+	DW	1&&0, 1&&2, 0||0, 0||3, 1+2=3&&4>3
+	DW	'A', 'AB', $10, 10H, 0x10, 10, 10D, 17O, %101, 101B
+	DW	$, *, ., $-START
+
+; symbols
+START	DW	START, LATER, LATER-START
+VAL	SET	5
+	DW	VAL*2
+VAL	SET	VAL+1
+	DW	VAL*2		; same text, new value
+	DB	..DEF START, ..DEF LATER, ..UNDEF NONE
+
+; local labels
+.here	DW	.here, .next
+.next	DW	.here
+
+; the same expression in each expansion
+DWX	MACRO	n
+	DW	n*n+VAL, $
+	ENDM
+
+	DWX	1
+	DWX	2
+VAL	SET	100
+	DWX	3
+
+LATER	RTS
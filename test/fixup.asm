@@ -0,0 +1,20 @@
+; with -q, data that uses labels defined later gets fixups,
+; and the object code is written after one pass
+
+	CPU	Z80
+
+	ORG	100H
+
+TABLE	DB	ONE-$,TWO-$,LAST-$	; $-relative bytes
+	DW	ONE,TWO,LAST
+	DB	LAST >> 8,LAST & 0FFH
+	DL	LAST-TABLE
+	DB	"AB",ONE-TABLE,0
+
+ONE	DB	1
+	DS	20
+TWO	DB	2
+	DW	ONE,TABLE	; known in pass 1
+	LD	HL,TABLE	; instructions must not use labels defined later
+	RET
+LAST
@@ -0,0 +1,15 @@
+; uses the symbols written by export.asm with -x
+
+	CPU	Z80
+
+	ORG	2000H
+
+	CALL	START
+	LD	B,TABLEN
+	LD	HL,TABLE
+	OUT	(PORT),A
+	DW	TABLE+TABLEN
+
+	IF	..UNDEF COUNT
+	DB	0		; COUNT was a SET symbol
+	ENDIF
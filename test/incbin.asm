@@ -0,0 +1,19 @@
+; INCBIN with offset and length
+
+	CPU	Z80
+
+	ORG	100H
+
+ALL	INCBIN	incbin.bin		; all 32 bytes
+TAIL	INCBIN	incbin.bin,24		; from offset 24 to the end
+MID	INCBIN	"incbin.bin",8,4	; 4 bytes from offset 8
+NONE	INCBIN	incbin.bin,32		; offset at the end, no bytes
+DONE	NOP
+
+; errors
+
+	INCBIN	incbin.bin,33		; offset outside of the file
+	INCBIN	incbin.bin,30,4		; length past the end
+	INCBIN	nofile.bin		; missing file
+	INCBIN	incbin.bin,LATER	; forward-declared offset
+LATER	EQU	2
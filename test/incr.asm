@@ -0,0 +1,16 @@
+; with -u, include files that have not changed are not assembled
+; again, their saved code and symbols are used instead
+
+	CPU	Z80
+
+	ORG	100H
+
+START	CALL	INIT
+	JR	MAIN
+
+	INCLUDE	incr1.inc
+	INCLUDE	incr2.inc
+
+MAIN	LD	A,COUNT
+	CALL	PRINT
+	HALT
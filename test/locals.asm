@@ -0,0 +1,29 @@
+; each parent label has its own table of '.' local labels,
+; and SUBR makes one parent for the labels after it
+
+	CPU	Z80
+
+	ORG	100H
+
+FIRST:	LD	B,3
+.LOOP:	DJNZ	.LOOP
+	JR	.DONE		; forward reference
+.DONE:	RET
+
+SECOND:	LD	B,4
+.LOOP:	DJNZ	.LOOP
+	JR	.DONE
+.DONE:	RET
+
+THIRD:	JR	.LOOP		; THIRD.LOOP, not the ones above
+	NOP
+.LOOP:	JR	.LOOP
+
+	SUBR	OUTER
+INNER1:	NOP
+.X:	JR	.X
+INNER2:	JR	.X		; still OUTER.X
+
+	SUBR
+LAST:	JR	.X		; LAST.X
+.X:	DB	0
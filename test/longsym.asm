@@ -0,0 +1,10 @@
+; a local label whose full name does not fit in 255 chars
+ CPU Z80
+ ORG 0
+AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA:
+ NOP
+.LOCAL_LABEL_WITH_A_LONGER_NAME_:
+ JR .LOCAL_LABEL_WITH_A_LONGER_NAME_
+NEXT:
+.LOCAL_LABEL_WITH_A_LONGER_NAME_:
+ JR .LOCAL_LABEL_WITH_A_LONGER_NAME_
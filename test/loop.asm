@@ -0,0 +1,45 @@
+; REPT, IRP and WHILE loops
+
+	CPU	Z80
+	LIST	MACRO
+
+	ORG	100H
+
+SQUARES	REPT	8, I		; a table of squares
+	DB	I*I
+	ENDR
+
+	IRP	REG, BC, DE, HL	; push three registers
+	PUSH	REG
+	ENDR
+
+N	SET	1
+	WHILE	N < 100		; powers of two below 100
+	DB	N
+N	SET	N*2
+	ENDW
+
+	REPEAT	2		; nested loops
+	IRP	X, 1, 2
+	DB	X
+	ENDR
+	REPEND
+
+	REPT	0		; no times around
+	DB	0FFH
+	ENDR
+
+	WHILE	0
+	ENDR			; an empty body is fine if it never runs
+	REPT	3
+	ENDR
+
+FILL	MACRO	n, v		; a loop inside a macro
+	REPT	n
+	DB	v
+	ENDR
+	ENDM
+
+	FILL	3, 0AAH
+	FILL	2, 55H
+	DW	SQUARES
@@ -0,0 +1,27 @@
+; errors in REPT, IRP and WHILE loops
+
+	CPU	Z80
+
+	ORG	100H
+
+	WHILE	1		; never ends, and has nothing to repeat
+	ENDR
+
+	WHILE	LATER-$		; label defined later
+	NOP
+	ENDR
+
+	REPT	LATER		; label defined later
+	NOP
+	ENDR
+
+	REPT	-1
+	NOP
+	ENDR
+
+	ENDR			; without a loop
+
+LATER	DB	2
+
+	REPT	2		; no ENDR
+	NOP
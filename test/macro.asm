@@ -0,0 +1,50 @@
+; macro lines are compiled once into text and parameter slots
+
+	CPU	Z80
+	LIST	MACRO
+
+	ORG	100H
+
+TWOBYTES MACRO	parm1, parm2
+	DB	parm1, parm2
+	ENDM
+
+	MACRO	plusfive parm
+	DB	(parm)+5
+	ENDM
+
+TEST	MACRO	labl
+labl ## 1 DB	1
+labl ## 2 DB	2
+	ENDM
+
+ARGS	MACRO	a, ab, abc
+	DB	\0		; number of parameters
+	DB	abc, ab, a	; names that start the same
+	DB	"a-ab-abc"	; replaced inside quotes too
+	DB	\3, \1
+TMP\?	DW	TMP\?		; unique label
+	ENDM
+
+OPTIONAL MACRO	a, b
+	IF	\0 > 1
+	DB	a, b
+	ELSE
+	DB	a		; b is empty
+	ENDIF
+	ENDM
+
+OUTER	MACRO	x
+	plusfive x
+	TWOBYTES x, x+1
+	ENDM
+
+	TWOBYTES 1, 2
+	plusfive 10
+	TEST	HERE
+	ARGS	1, 2, 3
+	ARGS	2*2, 'z', 4+1
+	OPTIONAL 5, 6
+	OPTIONAL 7
+	OUTER	8
+	DW	HERE1, HERE2
@@ -0,0 +1,159 @@
+; macro names are looked up in a hash table after the opcodes,
+; and pass 2 passes over macro bodies that pass 1 read without errors
+
+	CPU	Z80
+
+	ORG	100H
+
+M0	MACRO	n
+	DB	n+0
+	ENDM
+M1	MACRO	n
+	DB	n+1
+	ENDM
+M2	MACRO	n
+	DB	n+2
+	ENDM
+M3	MACRO	n
+	DB	n+3
+	ENDM
+M4	MACRO	n
+	DB	n+4
+	ENDM
+M5	MACRO	n
+	DB	n+5
+	ENDM
+M6	MACRO	n
+	DB	n+6
+	ENDM
+M7	MACRO	n
+	DB	n+7
+	ENDM
+M8	MACRO	n
+	DB	n+8
+	ENDM
+M9	MACRO	n
+	DB	n+9
+	ENDM
+M10	MACRO	n
+	DB	n+10
+	ENDM
+M11	MACRO	n
+	DB	n+11
+	ENDM
+M12	MACRO	n
+	DB	n+12
+	ENDM
+M13	MACRO	n
+	DB	n+13
+	ENDM
+M14	MACRO	n
+	DB	n+14
+	ENDM
+M15	MACRO	n
+	DB	n+15
+	ENDM
+M16	MACRO	n
+	DB	n+16
+	ENDM
+M17	MACRO	n
+	DB	n+17
+	ENDM
+M18	MACRO	n
+	DB	n+18
+	ENDM
+M19	MACRO	n
+	DB	n+19
+	ENDM
+M20	MACRO	n
+	DB	n+20
+	ENDM
+M21	MACRO	n
+	DB	n+21
+	ENDM
+M22	MACRO	n
+	DB	n+22
+	ENDM
+M23	MACRO	n
+	DB	n+23
+	ENDM
+M24	MACRO	n
+	DB	n+24
+	ENDM
+M25	MACRO	n
+	DB	n+25
+	ENDM
+M26	MACRO	n
+	DB	n+26
+	ENDM
+M27	MACRO	n
+	DB	n+27
+	ENDM
+M28	MACRO	n
+	DB	n+28
+	ENDM
+M29	MACRO	n
+	DB	n+29
+	ENDM
+M30	MACRO	n
+	DB	n+30
+	ENDM
+M31	MACRO	n
+	DB	n+31
+	ENDM
+M32	MACRO	n
+	DB	n+32
+	ENDM
+M33	MACRO	n
+	DB	n+33
+	ENDM
+M34	MACRO	n
+	DB	n+34
+	ENDM
+M35	MACRO	n
+	DB	n+35
+	ENDM
+M36	MACRO	n
+	DB	n+36
+	ENDM
+M37	MACRO	n
+	DB	n+37
+	ENDM
+M38	MACRO	n
+	DB	n+38
+	ENDM
+M39	MACRO	n
+	DB	n+39
+	ENDM
+
+NOP	MACRO			; an opcode is found before a macro of the same name
+	DB	0FFH
+	ENDM
+
+LOCAL	MACRO	n
+.skip	DB	n		; local label in the body
+	ENDM
+
+START	NOP
+GLOBAL	MACRO
+INNER	DB	0		; scopes .here, pass 2 must keep that
+	ENDM
+.here	JR	.here
+	m0	1		; names are not case sensitive
+	M7	1
+	M39	1
+	LOCAL	2
+	GLOBAL
+
+	IF	0
+SKIP	MACRO
+	DB	1
+	ENDM
+	ENDIF
+
+	SKIP			; not defined, it was in a failed IF
+
+M1	MACRO			; defined twice
+	DB	2
+	ENDM
+
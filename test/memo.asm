@@ -0,0 +1,45 @@
+; an expansion that uses only its parameters is kept, and later
+; expansions with the same parameters reuse its code and listing
+
+	CPU	Z80
+	LIST	MACRO
+
+	ORG	100H
+
+OUTB	MACRO	port, val	; uses only its parameters
+	LD	A,val
+	OUT	(port),A
+	ENDM
+
+BYTES	MACRO	a, b		; data only
+	DB	a, b
+	DW	a*256+b
+	ENDM
+
+HERE	MACRO	n		; uses $, never kept
+	DW	$+n
+	ENDM
+
+SYM	MACRO	n		; uses a symbol, never kept
+	DB	n+BIAS
+	ENDM
+
+BIAS	SET	1
+	OUTB	10H, 1
+	HERE	2
+	SYM	3
+	BYTES	1, 2
+	OUTB	10H, 1
+	HERE	2
+	SYM	3
+	BYTES	1, 2
+	OUTB	10H, 1		; the same code twice, reused from here on
+	BYTES	1, 2
+	OUTB	10H, 1
+	OUTB	10H, 2		; other parameters
+BIAS	SET	2
+	SYM	3		; new BIAS
+	OUTB	10H, 1
+	CPU	8080		; another CPU, kept expansions are not used
+	BYTES	1, 2
+	BYTES	1, 2
@@ -0,0 +1,13 @@
+; an include file that is read again, by the same name or another
+; path to it, comes from the copy already in memory
+
+	CPU	Z80
+
+	ORG	100H
+
+N	SET	0
+	INCLUDE	reinc.inc
+	INCLUDE	./reinc.inc
+	INCLUDE	reinc.inc
+
+	DB	N
@@ -0,0 +1,20 @@
+; with -p, labels defined later can get the zero page form,
+; and the passes repeat until no label moves
+
+	CPU	6502
+
+	ORG	$00F0
+
+START	LDA	VAR1		; zero page after the first pass
+	STA	VAR2
+	LDX	VAR3,Y
+	JMP	START
+
+VAR1	DB	1
+VAR2	DB	2
+VAR3	DB	3
+	DS	4
+FAR	DB	4		; past $FF, stays absolute
+	LDA	FAR
+	LDA	NEXT		; absolute in every pass
+NEXT	RTS
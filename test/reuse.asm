@@ -0,0 +1,31 @@
+; pass 2 reuses the code of lines that can't change, and
+; assembles the lines with forward references again
+
+	CPU	6502
+
+ZP	EQU	$12
+
+	ORG	$1000
+
+BACK	LDA	#1		; known in pass 1
+	STA	BACK
+	JMP	FWD		; forward reference
+	LDA	ZP		; zero page form
+	LDA	FWD		; forward reference, absolute form
+	BNE	BACK
+
+VAL	SET	1
+	DB	VAL
+VAL	SET	VAL+1
+	DB	VAL		; same line text, new value
+
+	IF	BACK < $1000
+	NOP
+	ELSE
+	BRK
+	ENDIF
+
+.local	INX
+	BNE	.local
+FWD	RTS
+	DW	FWD,BACK
@@ -0,0 +1,21 @@
+; names that share a prefix must sort the same way as before,
+; whatever their length, and long names take more than one column
+
+	CPU	Z80
+
+	ORG	0
+
+AB	EQU	1
+A	EQU	2
+AAA	EQU	3
+A_	EQU	4
+AA	EQU	5
+A1	EQU	6
+ABC	EQU	7
+A0	EQU	8
+LONG_NAME_OF_TWENTY_	EQU	9
+LONG_NAME_OF_TWENTY	EQU	10
+LONG_NAME_OF_TWENTY_ONE_CHARS_AND_THEN_SOME	EQU	11
+LONG	EQU	12
+B	EQU	13
+Z	DB	A,AA,AAA,AB,ABC,A_,A0,A1
@@ -0,0 +1,19 @@
+; the first opcode table entry that matches wins, wildcard or not,
+; and the CPU's opcodes come before the pseudo-ops
+
+	CPU	ARM
+
+	ORG	0
+
+	BL	.		; exact entries
+	BLS	.
+	BLX	R1		; wildcards with and without a suffix
+	BLXEQ	R1
+	BX	R1
+	MOVS	R1,R2
+	ADDEQS	R1,R2,R3
+	NOP
+
+	SUBR	R1,R2,R3	; SUB* with a bad suffix, not SUBR
+	.SUBR			; but .SUBR can only be the pseudo-op
+	SUB	R1,R2,R3